@@ -0,0 +1,508 @@
+// buf.c ... shared page buffer pool
+// part of Multi-attribute Linear-hashed Files
+// Caches data and overflow pages in a fixed set of frames
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "defs.h"
+#include "buf.h"
+#include "page.h"
+#include "codec.h"
+#include "wal.h"
+
+// The pool is NBUFS frames, shared by all open files
+// - each frame has room for a page of up to MAXPAGESIZE bytes,
+//   but that space is only reserved, not allocated; a frame gets
+//   memory for the largest page it has held (so a process working
+//   on a 1K-page relation uses 1/64th of the reserved space)
+// - a frame is identified by (FILE *, PageID)
+// - bufFetch() pins a frame, reading the page from file on a miss
+// - bufRelease() unpins it, optionally marking it dirty
+// - dirty frames are only written back when evicted, or when
+//   the file is flushed/dropped (e.g. by closeRelation())
+// - victims are chosen by the clock algorithm over unpinned frames
+// Page I/O uses pread/pwrite on the file's descriptor, so it
+//   never touches the FILE's stdio buffer or file position
+// The pool may be used from several threads at once
+// - the frame table is protected by a single latch
+// - reads and write-backs happen outside the latch; a frame being
+//   read or written is marked busy, and other users of that page
+//   wait for it
+// - frame buffers are aligned, so files may use O_DIRECT
+// Files with a codec (see codec.c) hold compressed page images
+// - an image is a Count (PACKED|length) followed by the bytes
+// - it is written at the page's usual offset, so only hdr+length
+//   bytes (rounded up to a sector) are written, and read back by
+//   reading the first sector and then just the rest of the image
+// - the whole file system blocks after the image are released
+//   (hole punched); a page's slot starts on a block boundary, and
+//   the block holding the image's end is kept, so disk space is
+//   saved only when a page spans two or more blocks (e.g. 8K pages
+//   and up on a file system with 4K blocks; 4K pages save nothing)
+// - the logical page is unchanged, so a page holds no more tuples
+//   than it would uncompressed, and overflow chains are no shorter;
+//   the saving is in bytes transferred, not in pages
+// - a page which does not compress is written as it is; its first
+//   word (the page's free offset) is always < PACKED
+// Files attached to a write-ahead log (see wal.c) are not written
+//   by the pool; their pages go to the log instead, and are read
+//   back from there if they are evicted and needed again
+
+#define NHASH (2*NBUFS)
+#define NOFRAME (-1)
+#define BUFALIGN 4096
+#define PACKED   0x80000000
+#define SECTOR   512
+
+typedef struct {
+	FILE  *file;  // file holding the page (NULL if frame is free)
+	PageID pid;   // page within file
+	Count  size;  // page size of file
+	Count  cap;   // bytes of memory the frame has (0 .. MAXPAGESIZE)
+	int    codec; // compression codec of file
+	Count  blk;   // file system block size of file
+	Count  pin;   // number of current users of the frame
+	Bool   dirty; // modified since read from file
+	Bool   ref;   // clock reference bit
+	Bool   busy;  // being read from or written to file
+	int    next;  // next frame in same hash chain
+} Frame;
+
+static Frame frames[NBUFS];
+static char *pool = NULL;   // page buffers for all frames
+static int hashtab[NHASH];  // head of chain for each hash value
+static int hand = 0;        // clock hand
+
+static pthread_mutex_t latch = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loaded = PTHREAD_COND_INITIALIZER;
+
+static struct {
+	Count hits;    // requests satisfied from the pool
+	Count misses;  // requests which needed a read
+	Count writes;  // dirty frames written back
+	Count evicts;  // frames reused for another page
+	unsigned long long rbytes, wbytes;  // bytes transferred to/from files
+} stats;
+
+// allocate pool on first use (called with latch held)
+
+static void initPool()
+{
+	if (pool != NULL) return;
+	// address space only; frames are given memory by frameFit()
+	void *mem = mmap(NULL, (size_t)NBUFS*MAXPAGESIZE, PROT_NONE,
+	                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) fatal("Can't reserve buffer pool");
+	pool = mem;
+	for (int i = 0; i < NBUFS; i++) {
+		frames[i].file = NULL;
+		frames[i].cap = 0;
+		frames[i].pin = 0;
+		frames[i].dirty = frames[i].ref = frames[i].busy = FALSE;
+		frames[i].next = NOFRAME;
+	}
+	for (int h = 0; h < NHASH; h++) hashtab[h] = NOFRAME;
+}
+
+static char *frameData(int i) { return pool + (size_t)i*MAXPAGESIZE; }
+
+// make sure frame i has memory for a page of size bytes
+// (called with latch held, on a frame nobody is using)
+
+static void frameFit(int i, Count size)
+{
+	Frame *fr = &frames[i];
+	if (fr->cap >= size) return;
+	Count cap = (size + BUFALIGN-1) / BUFALIGN * BUFALIGN;
+	if (mprotect(frameData(i), cap, PROT_READ|PROT_WRITE) != 0)
+		fatal("Can't allocate buffer pool frame");
+	fr->cap = cap;
+}
+
+static int hashOf(FILE *f, PageID pid)
+{
+	unsigned long k = (unsigned long)f ^ ((unsigned long)pid * 2654435761u);
+	return (int)(k % NHASH);
+}
+
+// find frame holding (f,pid); NOFRAME if not in pool
+
+static int lookup(FILE *f, PageID pid)
+{
+	int i = hashtab[hashOf(f,pid)];
+	while (i != NOFRAME) {
+		if (frames[i].file == f && frames[i].pid == pid) return i;
+		i = frames[i].next;
+	}
+	return NOFRAME;
+}
+
+static void unhash(int i)
+{
+	int *p = &hashtab[hashOf(frames[i].file,frames[i].pid)];
+	while (*p != i) p = &frames[*p].next;
+	*p = frames[i].next;
+	frames[i].next = NOFRAME;
+}
+
+// transfer nbytes between buf and offset off in fd
+// in direct I/O mode, the device may refuse transfers that are
+//   not aligned to its block size; if so, drop back to buffered
+//   I/O for that file and try again
+// returns number of bytes transferred
+
+static ssize_t transfer(int fd, char *buf, Count nbytes, off_t off, Bool write)
+{
+	for (;;) {
+		ssize_t n;
+		if (write)
+			n = pwrite(fd, buf, nbytes, off);
+		else
+			n = pread(fd, buf, nbytes, off);
+		if (n >= 0) {
+			// (transfers happen outside the latch)
+			__atomic_add_fetch(write ? &stats.wbytes : &stats.rbytes,
+			                   n, __ATOMIC_RELAXED);
+			return n;
+		}
+		int flags = fcntl(fd, F_GETFL);
+		if (errno == EINVAL && (flags & O_DIRECT)) {
+			fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+			continue;
+		}
+		fatal(write ? "Can't write page" : "Can't read page");
+	}
+}
+
+// write page buf as a compressed image, if it compresses
+
+// (image buffers are aligned, and transfers are whole sectors,
+//   so that compressed files may still use O_DIRECT)
+
+static Count sectors(Count nbytes, Count size)
+{
+	Count n = (nbytes + SECTOR-1) / SECTOR * SECTOR;
+	return (n < size) ? n : size;
+}
+
+static void writePacked(FILE *f, PageID pid, Count size, int codec,
+                        Count blk, char *buf)
+{
+	int fd = fileno(f);
+	off_t off = (off_t)pid*size;
+	char img[MAXPAGESIZE] __attribute__((aligned(BUFALIGN)));
+	Count hdr = sizeof(Count);
+	Count clen = compressPage(codec, buf, size, img+hdr, size-hdr-1);
+	if (clen == 0) {
+		if (transfer(fd, buf, size, off, TRUE) != size)
+			fatal("Can't write page");
+		return;
+	}
+	Count word = PACKED | clen;
+	memcpy(img, &word, hdr);
+	Count n = sectors(hdr+clen, size);
+	memset(img+hdr+clen, 0, n-hdr-clen);
+	if (transfer(fd, img, n, off, TRUE) != n)
+		fatal("Can't write page");
+	// give back whole blocks after the image (if file system can)
+	off_t start = ((off + hdr + clen + blk-1) / blk) * blk;
+	off_t end = (off + size) / blk * blk;
+	if (start < end)
+		fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		          start, end-start);
+}
+
+// read page buf from a compressed image (or an uncompressed page)
+// the first sector tells how long the image is, and only the
+//   sectors holding the rest of it are then read
+
+static void readPacked(FILE *f, PageID pid, Count size, int codec, char *buf)
+{
+	int fd = fileno(f);
+	off_t off = (off_t)pid*size;
+	char img[MAXPAGESIZE] __attribute__((aligned(BUFALIGN)));
+	Count hdr = sizeof(Count);
+	Count first = sectors(hdr, size);
+	ssize_t n = transfer(fd, img, first, off, FALSE);
+	Count word = 0;
+	if (n >= hdr) memcpy(&word, img, hdr);
+	Count need = (word & PACKED) ? sectors(hdr + (word & ~PACKED), size)
+	                             : size;
+	if (n == first && need > first)
+		n += transfer(fd, img+first, need-first, off+first, FALSE);
+	if (!(word & PACKED)) {
+		if (n != size) fatal("Can't read page");
+		memcpy(buf, img, size);
+		return;
+	}
+	Count clen = word & ~PACKED;
+	if (hdr+clen > n || expandPage(codec, img+hdr, clen, buf, size) != OK)
+		fatal("Corrupt compressed page");
+}
+
+// transfer one page between buf and its place in file f
+
+static void fileIO(FILE *f, PageID pid, Count size, int codec, Count blk,
+                   char *buf, Bool write)
+{
+	if (codec != CODEC_NONE) {
+		if (write)
+			writePacked(f, pid, size, codec, blk, buf);
+		else
+			readPacked(f, pid, size, codec, buf);
+		return;
+	}
+	int fd = fileno(f);
+	off_t off = (off_t)pid*size;
+	if (transfer(fd, buf, size, off, write) != size)
+		fatal(write ? "Can't write page" : "Can't read page");
+}
+
+// transfer one page between frame i and its file (or log)
+
+static void pageIO(int i, Bool write)
+{
+	Frame *fr = &frames[i];
+	Wal w = fileWal(fr->file);
+	if (w != NULL) {
+		if (write) {
+			walWrite(w, fr->file, fr->pid, frameData(i));
+			return;
+		}
+		if (walRead(w, fr->file, fr->pid, frameData(i)) == OK)
+			return;
+	}
+	fileIO(fr->file, fr->pid, fr->size, fr->codec, fr->blk,
+	       frameData(i), write);
+}
+
+// write back frame i (called with latch held)
+// the latch is let go while the page is compressed and written;
+//   meanwhile the frame is pinned, so it is not reused, and busy,
+//   so that anyone who looks it up waits until it has been written
+
+static void writeFrame(int i)
+{
+	Frame *fr = &frames[i];
+	fr->pin++;
+	fr->busy = TRUE;
+	fr->dirty = FALSE;
+	stats.writes++;
+	pthread_mutex_unlock(&latch);
+	pageIO(i, TRUE);
+	pthread_mutex_lock(&latch);
+	fr->busy = FALSE;
+	fr->pin--;
+	pthread_cond_broadcast(&loaded);
+}
+
+// choose a frame to (re)use, writing back its old contents
+// (called with latch held, but writing a frame back lets go of it,
+//   so the caller must check again that its page is not in the pool)
+
+static int victim()
+{
+	for (int n = 0; n < 2*NBUFS; n++) {
+		int i = hand;
+		hand = (hand+1) % NBUFS;
+		Frame *fr = &frames[i];
+		if (fr->file == NULL) return i;
+		if (fr->pin > 0) continue;
+		if (fr->ref) { fr->ref = FALSE; continue; }
+		if (fr->dirty) {
+			writeFrame(i);
+			// someone may have wanted the page while it was written
+			if (fr->pin > 0 || fr->dirty || fr->ref) continue;
+		}
+		unhash(i);
+		fr->file = NULL;
+		stats.evicts++;
+		return i;
+	}
+	fatal("Buffer pool exhausted: all frames pinned");
+	return NOFRAME;
+}
+
+// pin frame for (f,pid); load it from file if asked
+
+static int grab(FILE *f, PageID pid, Bool load)
+{
+	pthread_mutex_lock(&latch);
+	initPool();
+	int i;
+	for (;;) {
+		i = lookup(f, pid);
+		if (i != NOFRAME) {
+			stats.hits++;
+			frames[i].pin++;
+			frames[i].ref = TRUE;
+			while (frames[i].busy)
+				pthread_cond_wait(&loaded, &latch);
+			pthread_mutex_unlock(&latch);
+			return i;
+		}
+		i = victim();
+		// (another thread may have brought in the page meanwhile,
+		//   in which case frame i is simply left free)
+		if (lookup(f, pid) == NOFRAME) break;
+	}
+	Frame *fr = &frames[i];
+	fr->file = f; fr->pid = pid;
+	fr->size = filePageSize(f);
+	frameFit(i, fr->size);
+	fr->codec = fileCodec(f);
+	fr->blk = fileBlockSize(f);
+	fr->dirty = FALSE;
+	fr->pin = 1;
+	fr->ref = TRUE;
+	fr->busy = load;
+	int h = hashOf(f,pid);
+	fr->next = hashtab[h];
+	hashtab[h] = i;
+	if (load) stats.misses++;
+	pthread_mutex_unlock(&latch);
+	if (load) {
+		pageIO(i, FALSE);
+		pthread_mutex_lock(&latch);
+		fr->busy = FALSE;
+		pthread_cond_broadcast(&loaded);
+		pthread_mutex_unlock(&latch);
+	}
+	return i;
+}
+
+// return pinned buffer holding contents of page pid in f
+
+char *bufFetch(FILE *f, PageID pid)
+{
+	return frameData(grab(f, pid, TRUE));
+}
+
+// return pinned buffer for page pid in f, without reading it
+// caller is about to overwrite the entire page
+
+char *bufClaim(FILE *f, PageID pid)
+{
+	return frameData(grab(f, pid, FALSE));
+}
+
+// write page buf straight to its place in f, bypassing the pool
+// (and any log); used to copy logged pages to their files
+
+void bufWriteThrough(FILE *f, PageID pid, char *buf)
+{
+	fileIO(f, pid, filePageSize(f), fileCodec(f),
+	       fileBlockSize(f), buf, TRUE);
+}
+
+// measure the page images of the first npages pages of file f,
+//   from the header word at the start of each page's slot
+// sets *nbytes to the bytes the images take (a page stored raw
+//   takes the full page size) and *npacked to how many are packed
+// (pages only in the pool or the log are not seen, so this is
+//   exact only after a checkpoint)
+
+void bufImageSizes(FILE *f, PageID npages,
+                   unsigned long long *nbytes, Count *npacked)
+{
+	int fd = fileno(f);
+	Count size = filePageSize(f);
+	Count hdr = sizeof(Count);
+	Count first = sectors(hdr, size);
+	char img[MAXPAGESIZE] __attribute__((aligned(BUFALIGN)));
+	*nbytes = 0; *npacked = 0;
+	for (PageID pid = 0; pid < npages; pid++) {
+		Count word = 0;
+		if (transfer(fd, img, first, (off_t)pid*size, FALSE) >= hdr)
+			memcpy(&word, img, hdr);
+		if (fileCodec(f) != CODEC_NONE && (word & PACKED)) {
+			*nbytes += hdr + (word & ~PACKED);
+			(*npacked)++;
+		}
+		else
+			*nbytes += size;
+	}
+}
+
+// unpin a buffer; dirty means it must be written back eventually
+
+void bufRelease(char *buf, Bool dirty)
+{
+	assert(bufOwns(buf));
+	pthread_mutex_lock(&latch);
+	Frame *fr = &frames[(buf - pool) / MAXPAGESIZE];
+	assert(fr->pin > 0);
+	fr->pin--;
+	if (dirty) fr->dirty = TRUE;
+	pthread_mutex_unlock(&latch);
+}
+
+// is buf one of the pool's page buffers?
+
+Bool bufOwns(char *buf)
+{
+	return (pool != NULL && buf >= pool && buf < pool + (size_t)NBUFS*MAXPAGESIZE);
+}
+
+// write back all dirty pages belonging to f
+
+void bufFlush(FILE *f)
+{
+	if (pool == NULL) return;
+	pthread_mutex_lock(&latch);
+	for (int i = 0; i < NBUFS; i++) {
+		if (frames[i].file != f) continue;
+		while (frames[i].busy)
+			pthread_cond_wait(&loaded, &latch);
+		if (frames[i].file == f && frames[i].dirty) writeFrame(i);
+	}
+	pthread_mutex_unlock(&latch);
+}
+
+// write back and forget all pages belonging to f
+// must be called before f is closed
+
+void bufDrop(FILE *f)
+{
+	if (pool == NULL) return;
+	bufFlush(f);
+	pthread_mutex_lock(&latch);
+	for (int i = 0; i < NBUFS; i++) {
+		if (frames[i].file != f) continue;
+		assert(frames[i].pin == 0);
+		unhash(i);
+		frames[i].file = NULL;
+		frames[i].ref = FALSE;
+	}
+	pthread_mutex_unlock(&latch);
+}
+
+// forget pages of f from from onwards, without writing them back
+// (the file is being cut short, so they have nowhere to go)
+
+void bufForget(FILE *f, PageID from)
+{
+	if (pool == NULL) return;
+	pthread_mutex_lock(&latch);
+	for (int i = 0; i < NBUFS; i++) {
+		if (frames[i].file != f || frames[i].pid < from) continue;
+		assert(frames[i].pin == 0 && !frames[i].busy);
+		unhash(i);
+		frames[i].file = NULL;
+		frames[i].dirty = frames[i].ref = FALSE;
+	}
+	pthread_mutex_unlock(&latch);
+}
+
+// display buffer pool counters
+
+void bufStats()
+{
+	printf("Buffer pool: %d frames, %u hits, %u misses, %u writes, %u evictions\n",
+	       NBUFS, stats.hits, stats.misses, stats.writes, stats.evicts);
+	printf("Page I/O: %llu KB read, %llu KB written\n",
+	       stats.rbytes/1024, stats.wbytes/1024);
+}
@@ -0,0 +1,26 @@
+// buf.h ... interface to the shared page buffer pool
+// part of Multi-attribute Linear-hashed Files
+// See buf.c for details of buffer pool and functions
+
+#ifndef BUF_H
+#define BUF_H 1
+
+#include "defs.h"
+
+// number of frames in the pool (override with -DNBUFS=n)
+#ifndef NBUFS
+#define NBUFS 256
+#endif
+
+char *bufFetch(FILE *, PageID);
+char *bufClaim(FILE *, PageID);
+void bufWriteThrough(FILE *, PageID, char *);
+void bufRelease(char *, Bool);
+Bool bufOwns(char *);
+void bufFlush(FILE *);
+void bufDrop(FILE *);
+void bufForget(FILE *, PageID);
+void bufImageSizes(FILE *, PageID, unsigned long long *, Count *);
+void bufStats(void);
+
+#endif
@@ -0,0 +1,289 @@
+// bulk.c ... bulk loader
+// part of Multi-attribute Linear-hashed Files
+// Builds a relation from a large set of tuples in one pass over
+//   its pages, rather than by inserting the tuples one at a time
+
+#include "defs.h"
+#include "bulk.h"
+#include "reln.h"
+#include "page.h"
+#include "tuple.h"
+#include "bits.h"
+
+// Inserting tuples one by one touches pages at random, and each
+//   split re-reads and re-writes a whole bucket; instead, loading
+// - reads all the tuples first, computing the hash of each
+// - chooses the final number of buckets up front: the number the
+//   relation's split policy would have reached by splitting as the
+//   tuples were inserted (see split.c), so it has about the same
+//   depth and split pointer
+// - sorts the tuples by bucket (a counting sort on bucket number)
+// - writes each bucket's data page and its overflow pages in
+//   bucket order; every page is written once, and the data and
+//   overflow files each grow strictly sequentially
+// Tuples are held in memory as records (len, hash, tuple bytes)
+// If there are more than fit in the memory limit, they are
+//   spilled to a temporary file, then redistributed into K
+//   partition files, each holding a contiguous range of buckets
+//   (K is chosen so that a partition is about half the limit)
+// Partitions are then sorted and written one at a time, in order
+// The relation must be empty, as its files are rebuilt from
+//   scratch; and a load which does not finish leaves the relation
+//   unusable (it is not logged), so it must be created again
+
+#define RECHDR   (1 + sizeof(Bits))
+#define MAXPARTS 256
+
+typedef struct {
+	char  *buf;   // records, back to back
+	size_t used;  // bytes of records in buf
+	size_t size;  // bytes allocated for buf
+} Arena;
+
+static struct {
+	Count ntuples;    // tuples loaded
+	Count npages;     // data pages written
+	Count novflow;    // overflow pages written
+	Count nparts;     // partitions used (0 if all in memory)
+	unsigned long long spilled;  // bytes written to spill file
+} stats;
+
+// bytes in record rec
+static size_t recLength(char *rec)
+{
+	return RECHDR + (Byte)rec[0];
+}
+
+static Bits recHash(char *rec)
+{
+	Bits h;
+	memcpy(&h, rec+1, sizeof(Bits));
+	return h;
+}
+
+static Tuple recTuple(char *rec)
+{
+	return rec + RECHDR;
+}
+
+// add a record for tuple t with hash h to arena a
+static void addRecord(Arena *a, Bits h, Tuple t)
+{
+	Count n = tupLength(t);
+	if (a->used + RECHDR + n > a->size) {
+		a->size = (a->size == 0) ? 65536 : 2*a->size;
+		a->buf = realloc(a->buf, a->size);
+		assert(a->buf != NULL);
+	}
+	char *rec = a->buf + a->used;
+	rec[0] = n;
+	memcpy(rec+1, &h, sizeof(Bits));
+	memcpy(rec+RECHDR, t, n);
+	a->used += RECHDR + n;
+}
+
+// move all records in arena a to the end of file f
+static void spillArena(Arena *a, FILE *f)
+{
+	if (a->used > 0 && fwrite(a->buf, a->used, 1, f) != 1)
+		fatal("Can't write temporary file");
+	stats.spilled += a->used;
+	a->used = 0;
+}
+
+// read the next record from f into rec; returns its length,
+//   or 0 at end of file
+static size_t readRecord(FILE *f, char *rec)
+{
+	if (fread(rec, RECHDR, 1, f) != 1) return 0;
+	size_t n = recLength(rec);
+	if (fread(rec+RECHDR, n-RECHDR, 1, f) != 1)
+		fatal("Can't read temporary file");
+	return n;
+}
+
+// bucket holding hash h, in a file of given depth and split pointer
+// (as in addToRelation(), except that a depth of 0 means bucket 0)
+static PageID bucketOf(Bits h, Count d, Offset sp)
+{
+	if (d == 0) return 0;
+	PageID p = getLower(h, d);
+	if (p < sp) p = getLower(h, d+1);
+	return p;
+}
+
+// write bucket pid, holding the n tuples in recs[]
+// (and note its shape in the relation's directory, if it has one)
+static void writeBucket(Reln r, PageID pid, char **recs, Count n)
+{
+	FILE *f = dataFile(r);
+	Page pg = newPage(pageSize(r));
+	Bucket b = { n, 0, 1, NO_PAGE };
+	for (Count i = 0; i < n; i++) {
+		Tuple t = recTuple(recs[i]);
+		Bits h = recHash(recs[i]);
+		b.nbytes += tupleSpace(t);
+		if (addToPage(pg, t, h) == OK) continue;
+		// page is full, and the next overflow page written
+		//   will be its successor in the chain
+		FILE *ovf = ovflowFile(r);
+		pageSetOvflow(pg, fileNPages(ovf) + (f == ovf ? 1 : 0));
+		PageID p = appendPage(f, pg);
+		assert(f == ovf || p == pid);
+		f = ovf;
+		pg = newPage(pageSize(r));
+		b.npages++;
+		if (addToPage(pg, t, h) != OK)
+			fatal("Tuple too big for page");
+	}
+	PageID p = appendPage(f, pg);
+	assert(f != dataFile(r) || p == pid);
+	if (f != dataFile(r)) b.tail = p;
+	if (bucketDir(r) != NULL) *dirBucket(bucketDir(r), pid) = b;
+}
+
+// sort the records in buf[0..len) by bucket and write the buckets
+//   lo..hi-1 (which must include all of those records' buckets)
+static void writeBuckets(Reln r, char *buf, size_t len,
+                         PageID lo, PageID hi, Count d, Offset sp)
+{
+	Count nb = hi - lo;
+	Count *start = calloc(nb+1, sizeof(Count));
+	assert(start != NULL);
+	Count nrecs = 0;
+	for (size_t o = 0; o < len; o += recLength(buf+o)) {
+		PageID b = bucketOf(recHash(buf+o), d, sp);
+		assert(b >= lo && b < hi);
+		start[b-lo+1]++;
+		nrecs++;
+	}
+	for (Count b = 0; b < nb; b++) start[b+1] += start[b];
+	char **order = malloc((nrecs+1) * sizeof(char *));
+	Count *next = malloc((nb+1) * sizeof(Count));
+	assert(order != NULL && next != NULL);
+	memcpy(next, start, (nb+1) * sizeof(Count));
+	for (size_t o = 0; o < len; o += recLength(buf+o)) {
+		PageID b = bucketOf(recHash(buf+o), d, sp);
+		order[next[b-lo]++] = buf+o;
+	}
+	for (Count b = 0; b < nb; b++)
+		writeBucket(r, lo+b, order+start[b], start[b+1]-start[b]);
+	free(next);
+	free(order);
+	free(start);
+}
+
+// first bucket in partition k of nparts, over nbuckets buckets
+// (partition k holds buckets b with b*nparts/nbuckets == k)
+static PageID partStart(Count k, Count nparts, Count nbuckets)
+{
+	return ((unsigned long long)k*nbuckets + nparts-1) / nparts;
+}
+
+// load tuples from in (one per line, as for insert) into empty
+//   relation r, using about memlimit bytes to hold them
+// returns 0 status if successful, or -1 if r is not empty
+
+Status loadRelation(Reln r, FILE *in, size_t memlimit)
+{
+	if (ntuples(r) != 0) return -1;
+	Arena a = { NULL, 0, 0 };
+	FILE *spill = NULL;
+
+	// read tuples, spilling to disk when memory is full
+
+	// (tuples are read HASHBATCH at a time, to be hashed together)
+
+	Input input = openInput(in);
+	char bufs[HASHBATCH][MAXTUPBYTES];
+	Tuple ts[HASHBATCH];
+	Bits hs[HASHBATCH];
+	Count n = 0, k;
+	unsigned long long nbytes = 0;
+	do {
+		for (k = 0; k < HASHBATCH; k++)
+			if ((ts[k] = scanTuple(r, input, bufs[k])) == NULL) break;
+		tupleHashes(r, ts, k, hs);
+		for (Count i = 0; i < k; i++) {
+			addRecord(&a, hs[i], ts[i]);
+			nbytes += tupleSpace(ts[i]);
+		}
+		n += k;
+		if (a.used >= memlimit) {
+			if (spill == NULL && (spill = tmpfile()) == NULL)
+				fatal("Can't create temporary file");
+			spillArena(&a, spill);
+		}
+	} while (k == HASHBATCH);
+	closeInput(input);
+
+	// final shape, as the relation's split policy would make it
+
+	Count nb = relationTarget(r, n, nbytes);
+	setRelationSize(r, nb, n, nbytes);
+	Count d = depth(r);
+	Offset sp = splitp(r);
+	emptyFile(dataFile(r));
+	emptyFile(ovflowFile(r));
+
+	// write buckets, straight from memory if everything fits
+
+	if (spill == NULL) {
+		writeBuckets(r, a.buf, a.used, 0, nb, d, sp);
+		free(a.buf);
+	}
+	else {
+		spillArena(&a, spill);
+		free(a.buf);
+		Count k = 1;
+		while (k < MAXPARTS && k < nb && k*(memlimit/2) < stats.spilled)
+			k *= 2;
+		if (k > nb) k = nb;
+		FILE *parts[MAXPARTS];
+		for (Count i = 0; i < k; i++) {
+			parts[i] = tmpfile();
+			if (parts[i] == NULL)
+				fatal("Can't create temporary file");
+		}
+		char rec[RECHDR+256];
+		size_t len;
+		rewind(spill);
+		while ((len = readRecord(spill, rec)) > 0) {
+			PageID b = bucketOf(recHash(rec), d, sp);
+			Count i = (unsigned long long)b*k / nb;
+			if (fwrite(rec, len, 1, parts[i]) != 1)
+				fatal("Can't write temporary file");
+		}
+		fclose(spill);
+		for (Count i = 0; i < k; i++) {
+			long size = ftell(parts[i]);
+			char *buf = malloc(size > 0 ? size : 1);
+			assert(buf != NULL);
+			rewind(parts[i]);
+			if (size > 0 && fread(buf, size, 1, parts[i]) != 1)
+				fatal("Can't read temporary file");
+			fclose(parts[i]);
+			writeBuckets(r, buf, size, partStart(i, k, nb),
+			             partStart(i+1, k, nb), d, sp);
+			free(buf);
+		}
+		stats.nparts = k;
+	}
+	stats.ntuples = n;
+	stats.npages = fileNPages(dataFile(r));
+	stats.novflow = fileNPages(ovflowFile(r));
+	return OK;
+}
+
+// display loader counters for this process
+
+void loadStats()
+{
+	printf("Bulk load: %u tuples, %u data pages, %u overflow pages, ",
+	       stats.ntuples, stats.npages, stats.novflow);
+	if (stats.nparts == 0)
+		printf("sorted in memory\n");
+	else
+		printf("%llu bytes spilled in %u partitions\n",
+		       stats.spilled, stats.nparts);
+}
@@ -0,0 +1,17 @@
+// bulk.h ... interface to the bulk loader
+// part of Multi-attribute Linear-hashed Files
+// See bulk.c for details of how a relation is loaded
+
+#ifndef BULK_H
+#define BULK_H 1
+
+#include "defs.h"
+#include "reln.h"
+
+// default memory for tuples before spilling to disk
+#define LOAD_MEMORY (256*1024*1024)
+
+Status loadRelation(Reln, FILE *, size_t);
+void loadStats(void);
+
+#endif
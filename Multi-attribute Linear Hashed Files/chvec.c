@@ -8,6 +8,12 @@
 #include "defs.h"
 #include "reln.h"
 #include "chvec.h"
+#include "bits.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_BMI2 1
+#endif
 
 // convert a a,b:a,b:a,b:...:a,b" representation
 //  of a choice vector into a ChVec
@@ -58,6 +64,170 @@ Status parseChVec(Reln r, char *str, ChVec cv)
 	return OK;
 }
 
+// the attributes a choice vector takes bits from, as a bit-mask
+//   (bit i set for attribute i); tuple hashes need only hash these
+
+Count chvecAttrs(ChVec cv)
+{
+	Count used = 0;
+	for (Count i = 0; i < MAXCHVEC; i++)
+		used |= 1u << cv[i].att;
+	return used;
+}
+
+// A choice vector is compiled, when a relation is opened, into the
+//   steps which make a tuple hash from the hashes of its values
+// - the bits taken from one attribute's hash, in choice vector
+//   order, are split into runs whose bit numbers go steadily up (or
+//   down); a run is then one step: PEXT gathers its bits from the
+//   value's hash, and PDEP spreads them into their places in the
+//   tuple hash (for a run going down, their places in the tuple hash
+//   reversed, so all such runs are put right by one bit reversal)
+// - without BMI2 (on other CPUs, or other than x86-64), each used
+//   attribute has instead four tables, one for each byte of its
+//   value's hash, giving the tuple hash bits which that byte sets
+// The default choice vector (see parseChVec()) has two runs for each
+//   attribute: bits 0 and 1 going up, then bits 31, 30, ... going down
+
+struct CvMapRep {
+	Count nsteps;
+	struct {
+		Byte att;   // attribute whose value's hash is used
+		Bool rev;   // bits go down (to is then reversed)
+		Bits from;  // bits taken (PEXT mask)
+		Bits to;    // where they go in the tuple hash (PDEP mask)
+	} step[MAXCHVEC];
+	Bits attbits[MAXCHVEC];  // tuple hash bits from each attribute
+	Bool bmi2;               // steps are run (else tables are used)
+	Count nused;             // attributes used, if tables are used
+	Byte used[MAXCHVEC];
+	Bits (*table)[4][256];   // table[i][k][v]: bits set when byte k
+	                         //   of attribute used[i]'s hash is v
+};
+
+// compile choice vector cv (see above)
+
+CvMap compileChVec(ChVec cv)
+{
+	CvMap m = calloc(1, sizeof(struct CvMapRep));
+	assert(m != NULL);
+	for (Count j = 0; j < MAXCHVEC; j++)
+		m->attbits[cv[j].att] |= 1u << j;
+
+	// runs, attribute by attribute
+	Count stepOf[MAXCHVEC];  // run holding bit j of the tuple hash
+	for (Count a = 0; a < MAXCHVEC; a++) {
+		int prev = -1, dir = 0;  // last bit in run; +1 up, -1 down
+		for (Count j = 0; j < MAXCHVEC; j++) {
+			if (cv[j].att != a) continue;
+			int bit = cv[j].bit;
+			int d = (bit > prev) ? 1 : -1;
+			if (prev < 0 || bit == prev || (dir != 0 && d != dir)) {
+				m->step[m->nsteps].att = a;
+				m->nsteps++;
+				dir = 0;
+			}
+			else if (dir == 0) {
+				// a run's second bit sets its direction
+				dir = d;
+				m->step[m->nsteps-1].rev = (d < 0);
+			}
+			stepOf[j] = m->nsteps-1;
+			prev = bit;
+		}
+	}
+	for (Count j = 0; j < MAXCHVEC; j++) {
+		Count s = stepOf[j];
+		m->step[s].from |= 1u << cv[j].bit;
+		m->step[s].to |= 1u << (m->step[s].rev ? 31 - j : j);
+	}
+
+#ifdef HAVE_BMI2
+	m->bmi2 = (__builtin_cpu_supports("bmi2") != 0);
+#endif
+	if (m->bmi2) return m;
+
+	// tables, built up a bit at a time
+	for (Count a = 0; a < MAXCHVEC; a++)
+		if (m->attbits[a] != 0) m->used[m->nused++] = a;
+	m->table = calloc(m->nused, sizeof(*m->table));
+	assert(m->table != NULL);
+	for (Count i = 0; i < m->nused; i++) {
+		for (Count j = 0; j < MAXCHVEC; j++) {
+			if (cv[j].att != m->used[i]) continue;
+			Bits *t = m->table[i][cv[j].bit / 8];
+			for (Count v = 0; v < 256; v++)
+				if (bitIsSet(v, cv[j].bit % 8)) t[v] |= 1u << j;
+		}
+	}
+	return m;
+}
+
+void freeCvMap(CvMap m)
+{
+	free(m->table);
+	free(m);
+}
+
+#ifdef HAVE_BMI2
+// x with its bits in reverse order
+
+static Bits reverse(Bits x)
+{
+	x = __builtin_bswap32(x);
+	x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+	x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+	x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+	return x;
+}
+
+__attribute__((target("bmi2")))
+static Bits runSteps(CvMap m, Bits *vals)
+{
+	Bits hash[2] = { 0, 0 };  // bits from runs going up, and down
+	for (Count s = 0; s < m->nsteps; s++) {
+		Bits v = _pext_u32(vals[m->step[s].att], m->step[s].from);
+		hash[m->step[s].rev ? 1 : 0] |= _pdep_u32(v, m->step[s].to);
+	}
+	return hash[0] | reverse(hash[1]);
+}
+#endif
+
+// the tuple hash made by m from the hashes of its values, vals[]
+//   (indexed by attribute; only those the choice vector uses are read)
+
+Bits cvHash(CvMap m, Bits *vals)
+{
+#ifdef HAVE_BMI2
+	if (m->bmi2) return runSteps(m, vals);
+#endif
+	Bits hash = 0;
+	for (Count i = 0; i < m->nused; i++) {
+		Bits v = vals[m->used[i]];
+		Bits (*t)[256] = m->table[i];
+		hash |= t[0][v & 0xff] | t[1][(v >> 8) & 0xff]
+		        | t[2][(v >> 16) & 0xff] | t[3][v >> 24];
+	}
+	return hash;
+}
+
+// the bits of a tuple hash which come from attribute att
+
+Bits cvAttrBits(CvMap m, Count att)
+{
+	return (att < MAXCHVEC) ? m->attbits[att] : 0;
+}
+
+// show how a choice vector was compiled
+
+void printCvMap(CvMap m)
+{
+	if (m->bmi2)
+		printf("Compiled to %u PEXT/PDEP steps\n", m->nsteps);
+	else
+		printf("Compiled to byte tables for %u attributes\n", m->nused);
+}
+
 // print a choice vector (for debugging)
 
 void printChVec(ChVec cv)
@@ -10,6 +10,7 @@
 
 #include "defs.h"
 #include "reln.h"
+#include "bits.h"
 
 #define MAXCHVEC 32
 
@@ -17,7 +18,15 @@ typedef struct _ChVecItem { Byte att; Byte bit; } ChVecItem;
 
 typedef ChVecItem ChVec[MAXCHVEC];
 
+typedef struct CvMapRep *CvMap;
+
 Status parseChVec(Reln r, char *str, ChVec cv);
 void printChVec(ChVec cv);
+Count chvecAttrs(ChVec cv);
+CvMap compileChVec(ChVec cv);
+void freeCvMap(CvMap m);
+Bits cvHash(CvMap m, Bits *vals);
+Bits cvAttrBits(CvMap m, Count att);
+void printCvMap(CvMap m);
 
 #endif
@@ -0,0 +1,213 @@
+// codec.c ... page compression codecs
+// part of Multi-attribute Linear-hashed Files
+// Compresses page images on their way to disk, and back again
+
+#include <time.h>
+#include "defs.h"
+#include "codec.h"
+
+// CODEC_LZ is a byte-oriented LZ77 codec in the style of LZ4
+// A compressed image is a sequence of (literals,match) pairs
+// - token byte: high nibble = #literals, low nibble = matchlen-4
+//   (a nibble of 15 means more length follows, in bytes of
+//   255,255,...,<255 which are added together)
+// - the literal bytes themselves
+// - 2-byte little-endian offset back to the start of the match
+// - any extra match length bytes
+// The final pair has only literals (possibly none)
+// Matches are found via a hash table on 4-byte sequences, which
+//   suits tuple text with many repeated words and separators
+
+#define MINMATCH 4
+#define HASHBITS 12
+#define MAXOFFSET 65535
+
+static char *names[NCODECS] = { "none", "lz" };
+
+static struct {
+	unsigned long long rawbytes;  // page bytes compressed
+	unsigned long long packbytes; // compressed bytes produced
+	unsigned long long packns;    // time spent compressing
+	unsigned long long expandns;  // time spent expanding
+	Count npack, nexpand;         // number of pages
+} stats;
+
+static unsigned long long nanos()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// map codec name to id; -1 if no such codec
+
+int codecId(char *name)
+{
+	for (int c = 0; c < NCODECS; c++)
+		if (strcmp(name, names[c]) == 0) return c;
+	return -1;
+}
+
+char *codecName(int codec)
+{
+	return (codec >= 0 && codec < NCODECS) ? names[codec] : "?";
+}
+
+static unsigned int read32(char *p)
+{
+	unsigned int v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+// append a length extension (n >= 15 already in nibble)
+// returns new output position, or -1 if out of room
+
+static int putLength(char *out, int o, Count cap, Count n)
+{
+	n -= 15;
+	while (n >= 255) {
+		if (o >= cap) return -1;
+		out[o++] = (char)255;
+		n -= 255;
+	}
+	if (o >= cap) return -1;
+	out[o++] = (char)n;
+	return o;
+}
+
+// emit nlit literals from lits, then a match (if mlen > 0)
+// returns new output position, or -1 if out of room
+
+static int putSequence(char *out, int o, Count cap, char *lits, Count nlit,
+                       Count off, Count mlen)
+{
+	if (o >= cap) return -1;
+	int tok = o++;
+	Byte t = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15 && (o = putLength(out, o, cap, nlit)) < 0) return -1;
+	if (o + nlit > cap) return -1;
+	memcpy(out+o, lits, nlit);
+	o += nlit;
+	if (mlen > 0) {
+		Count m = mlen - MINMATCH;
+		t |= (m < 15 ? m : 15);
+		if (o + 2 > cap) return -1;
+		out[o++] = off & 0xff;
+		out[o++] = (off >> 8) & 0xff;
+		if (m >= 15 && (o = putLength(out, o, cap, m)) < 0) return -1;
+	}
+	out[tok] = t;
+	return o;
+}
+
+static Count lzCompress(char *in, Count n, char *out, Count cap)
+{
+	int table[1 << HASHBITS];
+	for (int h = 0; h < (1 << HASHBITS); h++) table[h] = -1;
+	int ip = 0, anchor = 0, o = 0;
+	while (ip + MINMATCH <= n) {
+		unsigned int seq = read32(in+ip);
+		int h = (seq * 2654435761u) >> (32 - HASHBITS);
+		int ref = table[h];
+		table[h] = ip;
+		if (ref < 0 || ip - ref > MAXOFFSET || read32(in+ref) != seq) {
+			ip++;
+			continue;
+		}
+		Count len = MINMATCH;
+		while (ip + len < n && in[ref+len] == in[ip+len]) len++;
+		o = putSequence(out, o, cap, in+anchor, ip-anchor, ip-ref, len);
+		if (o < 0) return 0;
+		ip += len;
+		anchor = ip;
+	}
+	o = putSequence(out, o, cap, in+anchor, n-anchor, 0, 0);
+	return (o < 0) ? 0 : o;
+}
+
+// read a length extension; returns new input position, or -1
+
+static int getLength(char *in, int i, Count clen, Count *n)
+{
+	Byte b;
+	do {
+		if (i >= clen) return -1;
+		b = in[i++];
+		*n += b;
+	} while (b == 255);
+	return i;
+}
+
+static Status lzExpand(char *in, Count clen, char *out, Count n)
+{
+	int i = 0, o = 0;
+	while (i < clen) {
+		Byte t = in[i++];
+		Count nlit = t >> 4;
+		if (nlit == 15 && (i = getLength(in, i, clen, &nlit)) < 0) return -1;
+		if (i + nlit > clen || o + nlit > n) return -1;
+		memcpy(out+o, in+i, nlit);
+		i += nlit; o += nlit;
+		if (i >= clen) break;
+		if (i + 2 > clen) return -1;
+		Count off = (Byte)in[i] | ((Byte)in[i+1] << 8);
+		i += 2;
+		Count mlen = t & 15;
+		if (mlen == 15 && (i = getLength(in, i, clen, &mlen)) < 0) return -1;
+		mlen += MINMATCH;
+		if (off == 0 || off > o || o + mlen > n) return -1;
+		if (off >= mlen)
+			memcpy(out+o, out+o-off, mlen);
+		else  // match overlaps output, so byte at a time
+			for (Count k = 0; k < mlen; k++) out[o+k] = out[o+k-off];
+		o += mlen;
+	}
+	return (o == n) ? OK : -1;
+}
+
+// compress n bytes from in into at most cap bytes at out
+// returns compressed size, or 0 if it would not fit
+
+Count compressPage(int codec, char *in, Count n, char *out, Count cap)
+{
+	assert(codec == CODEC_LZ);
+	unsigned long long t0 = nanos();
+	Count clen = lzCompress(in, n, out, cap);
+	// pages are packed by eviction, prefetch and worker threads,
+	//   so the counters are bumped atomically
+	__atomic_add_fetch(&stats.packns, nanos() - t0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.npack, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.rawbytes, n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.packbytes, (clen > 0) ? clen : n,
+	                   __ATOMIC_RELAXED);
+	return clen;
+}
+
+// expand clen bytes from in back into the n-byte page at out
+// returns 0 status if successful, -1 if image is corrupt
+
+Status expandPage(int codec, char *in, Count clen, char *out, Count n)
+{
+	assert(codec == CODEC_LZ);
+	unsigned long long t0 = nanos();
+	Status ok = lzExpand(in, clen, out, n);
+	__atomic_add_fetch(&stats.expandns, nanos() - t0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.nexpand, 1, __ATOMIC_RELAXED);
+	return ok;
+}
+
+// display compression counters for this process
+
+void codecStats()
+{
+	if (stats.npack == 0 && stats.nexpand == 0) return;
+	double ratio = (stats.packbytes == 0) ? 1.0
+	             : (double)stats.rawbytes / stats.packbytes;
+	printf("Compression: %u pages packed (ratio %.2f, %.0f ns/page), "
+	       "%u pages expanded (%.0f ns/page)\n",
+	       stats.npack, ratio,
+	       stats.npack ? (double)stats.packns / stats.npack : 0.0,
+	       stats.nexpand,
+	       stats.nexpand ? (double)stats.expandns / stats.nexpand : 0.0);
+}
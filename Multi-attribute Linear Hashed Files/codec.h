@@ -0,0 +1,21 @@
+// codec.h ... interface to page compression codecs
+// part of Multi-attribute Linear-hashed Files
+// See codec.c for details of codecs and functions
+
+#ifndef CODEC_H
+#define CODEC_H 1
+
+#include "defs.h"
+
+// codec ids (stored in R.info)
+#define CODEC_NONE 0
+#define CODEC_LZ   1
+#define NCODECS    2
+
+int codecId(char *);
+char *codecName(int);
+Count compressPage(int, char *, Count, char *, Count);
+Status expandPage(int, char *, Count, char *, Count);
+void codecStats(void);
+
+#endif
@@ -1,18 +1,25 @@
 // create.c ... create an empty Relation
 // part of Multi-attribute linear-hashed files
 // Ask a query on a named file
-// Usage:  ./create  [-v]  RelName  #attrs  #pages  ChoiceVector
+// Usage:  ./create  [-v]  RelName  #attrs  #pages  ChoiceVector  [PageSize [Codec [Split [Hash]]]]
 // where #attrs = # of attributes in each tuple
 //	   #pages = initial (empty) pages in File
 //	   ChoiceVector = attr,bit:attr,bit:...
+//	   PageSize = bytes per page (power of 2, 1K..64K; default 1K)
+//	   Codec = how pages are compressed on disk (none or lz; default none)
+//	   Split = when to split buckets (see split.c; default load)
+//	   Hash = how values are hashed (jenkins, wy or xx; default jenkins)
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include "util.h"
 #include "reln.h"
+#include "codec.h"
+#include "split.h"
+#include "hash.h"
 
-#define USAGE "./create  [-v]  RelName  #attrs  #pages  ChoiceVector"
+#define USAGE "./create  [-v]  RelName  #attrs  #pages  ChoiceVector  [PageSize [Codec [Split [Hash]]]]"
 
 
 // Main ... process args, create relation
@@ -28,6 +35,15 @@ int main(int argc, char **argv)
 	char *attrs;   // number of attributes in tuples
 	char *pages;   // number of pages in data file
 	char *cv;	  // choice vector
+	char *psize;   // bytes per page (NULL for default)
+	int pagesize;  // bytes per page
+	char *cname;   // page compression codec (NULL for default)
+	int codec;     // page compression codec
+	char *sname;   // split policy (NULL for default)
+	SplitPolicy split;  // split policy
+	char spol[MAXERRMSG];  // printable split policy
+	char *hname;   // hash function (NULL for default)
+	int hash;      // hash function
 
 	// Process command-line args
 
@@ -35,10 +51,18 @@ int main(int argc, char **argv)
 	if (strcmp(argv[1], "-v") == 0) {
 		if (argc < 6) fatal(USAGE);
 	    verbose = 1; rname = argv[2]; attrs = argv[3]; pages = argv[4]; cv = argv[5];
+	    psize = (argc > 6) ? argv[6] : NULL;
+	    cname = (argc > 7) ? argv[7] : NULL;
+	    sname = (argc > 8) ? argv[8] : NULL;
+	    hname = (argc > 9) ? argv[9] : NULL;
 	}
 	else {
 		if (argc < 5) fatal(USAGE);
 	    verbose = 0; rname = argv[1]; attrs = argv[2]; pages = argv[3]; cv = argv[4];
+	    psize = (argc > 5) ? argv[5] : NULL;
+	    cname = (argc > 6) ? argv[6] : NULL;
+	    sname = (argc > 7) ? argv[7] : NULL;
+	    hname = (argc > 8) ? argv[8] : NULL;
 	}
 
 	// how many attributes in each tuple
@@ -54,13 +78,47 @@ int main(int argc, char **argv)
 		sprintf(err, "Invalid #pages: %d (must be 0 < # < 65)", nattrs);
 		fatal(err);
 	}
+	// how big is each page
+	pagesize = (psize == NULL) ? PAGESIZE : atoi(psize);
+	if (pagesize < MINPAGESIZE || pagesize > MAXPAGESIZE
+	    || (pagesize & (pagesize-1)) != 0) {
+		sprintf(err, "Invalid page size: %d (must be power of 2, %d..%d)",
+		        pagesize, MINPAGESIZE, MAXPAGESIZE);
+		fatal(err);
+	}
+	// how are pages compressed
+	codec = (cname == NULL) ? CODEC_NONE : codecId(cname);
+	if (codec < 0) {
+		sprintf(err, "Invalid codec: %s (must be none or lz)", cname);
+		fatal(err);
+	}
+
+	// when are buckets split
+	if (sname == NULL)
+		defaultSplitPolicy(&split);
+	else if (parseSplitPolicy(sname, &split) != OK) {
+		sprintf(err, "Invalid split policy: %.100s "
+		             "(count or load[,fill=N][,slack=N][,chain=N])", sname);
+		fatal(err);
+	}
+	showSplitPolicy(&split, spol);
+	// how are values hashed
+	hash = (hname == NULL) ? HASH_JENKINS : hashId(hname);
+	if (hash < 0) {
+		sprintf(err, "Invalid hash function: %.100s (must be jenkins, wy or xx)",
+		        hname);
+		fatal(err);
+	}
+
 	// convert to least 2^d >= npages
 	// d gives initial depth of file
 	int d = 0, np = 1;
 	while (np < npages) { d++; np <<= 1; }
 
 	if (verbose)
-		printf("#a=%d, #p=%d, d=%d\n", nattrs, np, d);
+		printf("#a=%d, #p=%d, d=%d, pagesize=%d, codec=%s, split=%s, "
+		       "hash=%s\n", nattrs, np, d, pagesize, codecName(codec), spol,
+		       hashName(hash));
 
 	// Open files for the Relation and initialise
 
@@ -68,7 +126,8 @@ int main(int argc, char **argv)
 		sprintf(err, "Relation %s already exists", rname);
 		fatal(err);
 	}
-	if (newRelation(rname, nattrs, np, d, cv) != OK) {
+	if (newRelation(rname, nattrs, np, d, cv, pagesize, codec, &split,
+	                hash) != OK) {
 		sprintf(err, "Problems while creating relation %s", rname);
 		fatal(err);
 	}
@@ -12,7 +12,9 @@
 #include <assert.h>
 #include "util.h"
 
-#define PAGESIZE    1024
+#define PAGESIZE    1024   // default (and pre-format 2) page size
+#define MINPAGESIZE 1024
+#define MAXPAGESIZE 65536
 #define NO_PAGE     0xffffffff
 #define MAXERRMSG   200
 #define MAXTUPLEN   200
@@ -0,0 +1,73 @@
+// delete.c ... remove tuples from a relation
+// part of Multi-attribute linear-hashed files
+// Delete the tuples matching a query from a named relation
+// Usage:  ./delete  [-v]  [-d]  RelName  v1,v2,v3,v4,...
+// where any of the vi's can be "?" (unknown), as for select
+// and -d uses direct I/O for pages (bypassing the OS cache)
+
+#include "defs.h"
+#include "reln.h"
+#include "buf.h"
+#include "fsm.h"
+#include "split.h"
+
+#define USAGE "./delete  [-v]  [-d]  RelName  v1,v2,v3,v4,..."
+
+// Main ... process args, delete tuples
+
+int main(int argc, char **argv)
+{
+	Reln r;  // handle on the open relation
+	char err[MAXERRMSG];  // buffer for error messages
+	int verbose;  // show extra info on deletion
+	int direct;   // use direct I/O
+	char *rname;  // name of table/file
+	char *qstr;   // query string
+
+	// process command-line args
+
+	if (argc < 3) fatal(USAGE);
+	verbose = direct = 0;
+	int a;
+	for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-d") == 0)
+			direct = 1;
+		else
+			fatal(USAGE);
+	}
+	if (a+1 >= argc) fatal(USAGE);
+	rname = argv[a];  qstr = argv[a+1];
+
+	// set up relation for writing
+
+	if (!existsRelation(rname)) {
+		sprintf(err, "No such relation: %s",rname);
+		fatal(err);
+	}
+	if ((r = openRelation(rname,"r+")) == NULL) {
+		sprintf(err, "Can't open relation: %s",rname);
+		fatal(err);
+	}
+	if (direct && useDirectIO(r) != OK)
+		fprintf(stderr, "Direct I/O not supported for %s\n", rname);
+
+	// delete matching tuples
+
+	int ndeleted = deleteFromRelation(r, qstr);
+	if (ndeleted < 0) {
+		sprintf(err, "Invalid query: %s",qstr);
+		fatal(err);
+	}
+
+	// clean up
+
+	closeRelation(r);
+	if (verbose) {
+		printf("Deleted %d tuples\n", ndeleted);
+		bufStats(); fsmStats(); splitStats();
+	}
+
+	return 0;
+}
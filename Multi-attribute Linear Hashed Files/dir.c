@@ -0,0 +1,108 @@
+// dir.c ... bucket directories
+// part of Multi-attribute Linear-hashed Files
+// Records the size and shape of each bucket of a relation, so
+//   that they are known without reading the bucket's pages
+
+#include "defs.h"
+#include "dir.h"
+
+// A directory is an array of Bucket entries, indexed by bucket
+//   (i.e. by the PageID of the bucket's data page)
+// It is kept up to date by the relation as tuples are added and
+//   removed and buckets are split and merged (see reln.c), and
+//   saved in R.dir as
+//   n, then the n entries
+
+struct DirRep {
+	Count   nbuckets;  // entries in use
+	Count   size;      // entries allocated
+	Bucket *buckets;
+};
+
+Dir newDir()
+{
+	Dir d = malloc(sizeof(struct DirRep));
+	assert(d != NULL);
+	d->nbuckets = d->size = 0;
+	d->buckets = NULL;
+	return d;
+}
+
+void freeDir(Dir d)
+{
+	free(d->buckets);
+	free(d);
+}
+
+Count dirNBuckets(Dir d) { return d->nbuckets; }
+
+static void empty(Bucket *e)
+{
+	e->ntuples = e->nbytes = 0;
+	e->npages = 1;
+	e->tail = NO_PAGE;
+}
+
+// make room for entries up to n; new ones are empty buckets
+
+static void grow(Dir d, Count n)
+{
+	if (n > d->size) {
+		Count size = (d->size == 0) ? 1024 : d->size;
+		while (size < n) size *= 2;
+		d->buckets = realloc(d->buckets, size * sizeof(Bucket));
+		assert(d->buckets != NULL);
+		d->size = size;
+	}
+	for (Count i = d->nbuckets; i < n; i++) empty(&d->buckets[i]);
+	if (n > d->nbuckets) d->nbuckets = n;
+}
+
+// entry for bucket b (added, empty, if b is a new bucket)
+
+Bucket *dirBucket(Dir d, PageID b)
+{
+	if (b >= d->nbuckets) grow(d, b+1);
+	return &d->buckets[b];
+}
+
+// make bucket b empty: one data page, no tuples
+
+void dirClear(Dir d, PageID b)
+{
+	empty(dirBucket(d, b));
+}
+
+// forget buckets n and after
+
+void dirTruncate(Dir d, Count n)
+{
+	if (n < d->nbuckets) d->nbuckets = n;
+}
+
+// read directory from current position in f
+// returns 0 status if successful, -1 if f holds no valid directory
+
+Status dirLoad(Dir d, FILE *f)
+{
+	Count n;
+	if (fread(&n, sizeof(Count), 1, f) != 1) return -1;
+	d->nbuckets = 0;
+	grow(d, n);
+	if (n > 0 && fread(d->buckets, sizeof(Bucket), n, f) != n) {
+		d->nbuckets = 0;
+		return -1;
+	}
+	return OK;
+}
+
+// write directory at current position in f
+
+void dirSave(Dir d, FILE *f)
+{
+	Count n = d->nbuckets;
+	int ok = fwrite(&n, sizeof(Count), 1, f);
+	if (n > 0)
+		ok = ok && fwrite(d->buckets, sizeof(Bucket), n, f) == n;
+	if (!ok) fatal("Can't write bucket directory");
+}
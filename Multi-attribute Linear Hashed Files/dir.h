@@ -0,0 +1,29 @@
+// dir.h ... interface to bucket directories
+// part of Multi-attribute Linear-hashed Files
+// See dir.c for details of directory layout and functions
+
+#ifndef DIR_H
+#define DIR_H 1
+
+typedef struct DirRep *Dir;
+
+#include "defs.h"
+
+// what a directory knows about one bucket
+typedef struct {
+	Count  ntuples;  // tuples in bucket
+	Count  nbytes;   // page space used by them (incl. slots)
+	Count  npages;   // pages in chain (incl. data page)
+	PageID tail;     // last overflow page (NO_PAGE if none)
+} Bucket;
+
+Dir newDir(void);
+void freeDir(Dir);
+Count dirNBuckets(Dir);
+Bucket *dirBucket(Dir, PageID);
+void dirClear(Dir, PageID);
+void dirTruncate(Dir, Count);
+Status dirLoad(Dir, FILE *);
+void dirSave(Dir, FILE *);
+
+#endif
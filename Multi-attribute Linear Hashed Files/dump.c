@@ -28,6 +28,8 @@ int main(int argc, char **argv)
 	Reln r = openRelation(relname,"r");
 	if (r == NULL)
 		fatal("Can't open relation");
+	adviseFile(dataFile(r), PAGE_SEQUENTIAL);
+	adviseFile(ovflowFile(r), PAGE_SEQUENTIAL);
 
 	for (Offset pid = 0; pid < npages(r); pid++) {
 		printf("Bucket[%d]\n",pid);
@@ -42,9 +44,9 @@ int main(int argc, char **argv)
 			ovpg = getPage(ovflowFile(r), ovp);
 			showAllTuples(ovpg);
 			ovp = pageOvflow(ovpg);
-			free(ovpg);
+			releasePage(ovpg);
 		}
-		free(pg);
+		releasePage(pg);
 	}
 	closeRelation(r);
 
@@ -55,10 +57,10 @@ int main(int argc, char **argv)
 
 void showAllTuples(Page pg)
 {
+		char buf[MAXTUPLEN];
 		Count ntups = pageNTuples(pg);
-		char *c = pageData(pg);
 		for (int i = 0; i < ntups; i++) {
-			printf("%s\n", c);
-			c += strlen(c) + 1;
+			tupleString(pageTuple(pg, i), buf);
+			printf("%s\n", buf);
 		}
 }
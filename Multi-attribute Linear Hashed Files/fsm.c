@@ -0,0 +1,179 @@
+// fsm.c ... free-space maps
+// part of Multi-attribute Linear-hashed Files
+// Records how full each page of a file is, so that inserts can
+//   find a page with room without reading the pages in between
+
+#include <pthread.h>
+#include "defs.h"
+#include "fsm.h"
+
+// A map has two entries for each page of one file
+// - free: the page's free bytes, in units of 1<<shift bytes
+//   (rounded down, so it never overstates the room in a page);
+//   shift is the least that fits any page's free bytes in a byte
+// - next: a copy of the page's ovflow link
+// So an insert can follow a bucket's chain, and skip pages with
+//   too little room, without reading them (see addToRelation())
+// The page layer keeps the map up to date as pages are written
+//   (see putPage() in page.c); so it is always exact, apart from
+//   the rounding of free
+// A map is saved as n, then free[0..n), then next[0..n)
+
+struct FsmRep {
+	Count   npages;  // entries in use
+	Count   size;    // entries allocated
+	Count   shift;   // free bytes are stored >> shift
+	Byte   *free;    // free[pid] (in units)
+	PageID *next;    // next[pid]
+	pthread_mutex_t lock;
+};
+
+static struct {
+	Count skipped;  // pages passed over without being read
+	Count updates;  // entries changed
+} stats;
+
+// maps for different files may be updated by different threads
+static pthread_mutex_t counting = PTHREAD_MUTEX_INITIALIZER;
+
+// make an empty map, for pages of the given size
+
+Fsm newFsm(Count pagesize)
+{
+	Fsm m = malloc(sizeof(struct FsmRep));
+	assert(m != NULL);
+	m->npages = m->size = 0;
+	m->shift = 0;
+	while (((pagesize-1) >> m->shift) > 255) m->shift++;
+	m->free = NULL;
+	m->next = NULL;
+	pthread_mutex_init(&m->lock, NULL);
+	return m;
+}
+
+void freeFsm(Fsm m)
+{
+	pthread_mutex_destroy(&m->lock);
+	free(m->free);
+	free(m->next);
+	free(m);
+}
+
+Count fsmNPages(Fsm m) { return m->npages; }
+
+// make room for entries up to n (called with lock held)
+
+static void grow(Fsm m, Count n)
+{
+	if (n > m->size) {
+		Count size = (m->size == 0) ? 1024 : m->size;
+		while (size < n) size *= 2;
+		m->free = realloc(m->free, size);
+		m->next = realloc(m->next, size * sizeof(PageID));
+		assert(m->free != NULL && m->next != NULL);
+		m->size = size;
+	}
+	for (Count i = m->npages; i < n; i++) {
+		m->free[i] = 0;
+		m->next[i] = NO_PAGE;
+	}
+	if (n > m->npages) m->npages = n;
+}
+
+// record that page pid has nfree bytes free, and ovflow link next
+
+void fsmSet(Fsm m, PageID pid, Count nfree, PageID next)
+{
+	pthread_mutex_lock(&m->lock);
+	grow(m, pid+1);
+	m->free[pid] = nfree >> m->shift;
+	m->next[pid] = next;
+	pthread_mutex_unlock(&m->lock);
+	pthread_mutex_lock(&counting);
+	stats.updates++;
+	pthread_mutex_unlock(&counting);
+}
+
+// forget pages npages onwards (all of them, if the file has been
+//   emptied)
+
+void fsmTruncate(Fsm m, Count npages)
+{
+	pthread_mutex_lock(&m->lock);
+	if (npages < m->npages) m->npages = npages;
+	pthread_mutex_unlock(&m->lock);
+}
+
+// at least how many bytes are free in page pid
+
+Count fsmFree(Fsm m, PageID pid)
+{
+	pthread_mutex_lock(&m->lock);
+	assert(pid < m->npages);
+	Count nfree = (Count)m->free[pid] << m->shift;
+	pthread_mutex_unlock(&m->lock);
+	return nfree;
+}
+
+// ovflow link of page pid
+
+PageID fsmNext(Fsm m, PageID pid)
+{
+	pthread_mutex_lock(&m->lock);
+	assert(pid < m->npages);
+	PageID next = m->next[pid];
+	pthread_mutex_unlock(&m->lock);
+	return next;
+}
+
+// read map from current position in f
+// returns 0 status if successful, -1 if f holds no valid map
+
+Status fsmLoad(Fsm m, FILE *f)
+{
+	Count n;
+	if (fread(&n, sizeof(Count), 1, f) != 1) return -1;
+	pthread_mutex_lock(&m->lock);
+	m->npages = 0;
+	grow(m, n);
+	Status ok = OK;
+	if (n > 0 && (fread(m->free, 1, n, f) != n ||
+	              fread(m->next, sizeof(PageID), n, f) != n)) {
+		m->npages = 0;
+		ok = -1;
+	}
+	pthread_mutex_unlock(&m->lock);
+	return ok;
+}
+
+// write map at current position in f
+
+void fsmSave(Fsm m, FILE *f)
+{
+	pthread_mutex_lock(&m->lock);
+	Count n = m->npages;
+	int ok = fwrite(&n, sizeof(Count), 1, f);
+	if (n > 0)
+		ok = ok && fwrite(m->free, 1, n, f) == n
+		        && fwrite(m->next, sizeof(PageID), n, f) == n;
+	pthread_mutex_unlock(&m->lock);
+	if (!ok) fatal("Can't write free-space map");
+}
+
+// note that n pages were passed over thanks to a map
+
+void fsmSkipped(Count n)
+{
+	pthread_mutex_lock(&counting);
+	stats.skipped += n;
+	pthread_mutex_unlock(&counting);
+}
+
+// display free-space map counters for this process
+
+void fsmStats()
+{
+	if (stats.updates == 0 && stats.skipped == 0) return;
+	printf("Free-space map: %u updates, %u full pages skipped\n",
+	       stats.updates, stats.skipped);
+}
@@ -0,0 +1,24 @@
+// fsm.h ... interface to free-space maps
+// part of Multi-attribute Linear-hashed Files
+// See fsm.c for details of map layout and functions
+
+#ifndef FSM_H
+#define FSM_H 1
+
+typedef struct FsmRep *Fsm;
+
+#include "defs.h"
+
+Fsm newFsm(Count);
+void freeFsm(Fsm);
+Count fsmNPages(Fsm);
+void fsmSet(Fsm, PageID, Count, PageID);
+void fsmTruncate(Fsm, Count);
+Count fsmFree(Fsm, PageID);
+PageID fsmNext(Fsm, PageID);
+Status fsmLoad(Fsm, FILE *);
+void fsmSave(Fsm, FILE *);
+void fsmSkipped(Count);
+void fsmStats(void);
+
+#endif
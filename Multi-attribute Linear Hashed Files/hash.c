@@ -1,4 +1,4 @@
-// hash.c ... hash function (from PostgreSQL)
+// hash.c ... hash functions
 // part of Multi-attribute Linear-hashed Files
 // Last modified by John Shepherd, July 2019
 
@@ -6,6 +6,17 @@
 #include "hash.h"
 #include "bits.h"
 
+// Each relation hashes attribute values with one of these, chosen
+//   when it is created and recorded in R.info (see hashBytes())
+// - HASH_JENKINS: hash_any() from PostgreSQL (Bob Jenkins' lookup2),
+//   the original, mixing 12 bytes per round in 32-bit words
+// - HASH_WY: in the style of wyhash; 8 bytes at a time, each pair
+//   of words mixed by one 64x64->128 bit multiply
+// - HASH_XX: xxHash32; four independent lanes of 4 bytes, so the
+//   multiplies of a 16-byte stripe overlap
+// The 64-bit result of HASH_WY is folded to 32 bits, as only that
+//   many are used by choice vectors
+
 #define rot(x,k) (((x)<<(k)) | ((x)>>(32-(k))))
 
 #define mix(a,b,c) \
@@ -95,3 +106,334 @@ hash_any(unsigned char *k, int keylen)
 	final(a, b, c);
 	return c;
 }
+
+#define rotl32(x,k) (((x)<<(k)) | ((x)>>(32-(k))))
+
+static unsigned long long read64(unsigned char *p)
+{
+	unsigned long long v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static Bits read32(unsigned char *p)
+{
+	Bits v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+// wyhash-style hash
+
+#define WY0 0xa0761d6478bd642fULL
+#define WY1 0xe7037ed1a0b428dbULL
+#define WY2 0x8ebc6af09c88c6e3ULL
+
+// multiply a and b, and fold the 128-bit product to 64 bits
+static unsigned long long wymix(unsigned long long a, unsigned long long b)
+{
+	unsigned __int128 r = (unsigned __int128)a * b;
+	return (unsigned long long)(r >> 64) ^ (unsigned long long)r;
+}
+
+Bits
+hash_wy(unsigned char *k, int keylen)
+{
+	unsigned long long seed = WY0, a, b;
+	Count len = keylen;
+	if (len <= 16) {
+		if (len >= 4) {
+			// two overlapping reads of 4 bytes from each end
+			Count mid = (len >> 3) << 2;
+			a = ((unsigned long long)read32(k) << 32) | read32(k + mid);
+			b = ((unsigned long long)read32(k + len - 4) << 32)
+			    | read32(k + len - 4 - mid);
+		}
+		else if (len > 0) {
+			a = ((unsigned long long)k[0] << 16) | (k[len >> 1] << 8)
+			    | k[len-1];
+			b = 0;
+		}
+		else
+			a = b = 0;
+	}
+	else {
+		while (len > 16) {
+			seed = wymix(read64(k) ^ WY1, read64(k+8) ^ seed);
+			k += 16;
+			len -= 16;
+		}
+		// last 16 bytes (overlapping what was mixed, if need be)
+		a = read64(k + len - 16);
+		b = read64(k + len - 8);
+	}
+	unsigned long long h = wymix(WY1 ^ keylen, wymix(a ^ WY1, b ^ seed ^ WY2));
+	return (Bits)(h ^ (h >> 32));
+}
+
+// xxHash32 (with seed 0)
+
+#define XX1 2654435761U
+#define XX2 2246822519U
+#define XX3 3266489917U
+#define XX4 668265263U
+#define XX5 374761393U
+
+static Bits xxround(Bits v, Bits in)
+{
+	v += in * XX2;
+	v = rotl32(v, 13);
+	return v * XX1;
+}
+
+Bits
+hash_xx(unsigned char *k, int keylen)
+{
+	unsigned char *end = k + keylen;
+	Bits h;
+	if (keylen >= 16) {
+		Bits v1 = XX1 + XX2, v2 = XX2, v3 = 0, v4 = -XX1;
+		do {
+			v1 = xxround(v1, read32(k));
+			v2 = xxround(v2, read32(k+4));
+			v3 = xxround(v3, read32(k+8));
+			v4 = xxround(v4, read32(k+12));
+			k += 16;
+		} while (end - k >= 16);
+		h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+	}
+	else
+		h = XX5;
+	h += keylen;
+	for (; end - k >= 4; k += 4) {
+		h += read32(k) * XX3;
+		h = rotl32(h, 17) * XX4;
+	}
+	for (; k < end; k++) {
+		h += *k * XX5;
+		h = rotl32(h, 11) * XX1;
+	}
+	h ^= h >> 15;
+	h *= XX2;
+	h ^= h >> 13;
+	h *= XX3;
+	h ^= h >> 16;
+	return h;
+}
+
+static char *names[NHASHES] = { "jenkins", "wy", "xx" };
+static HashFn fns[NHASHES] = { hash_any, hash_wy, hash_xx };
+
+// map hash function name to id; -1 if no such function
+
+int hashId(char *name)
+{
+	for (int h = 0; h < NHASHES; h++)
+		if (strcmp(name, names[h]) == 0) return h;
+	return -1;
+}
+
+char *hashName(int hash)
+{
+	return (hash >= 0 && hash < NHASHES) ? names[hash] : "?";
+}
+
+// hash the len bytes at k with hash function hash
+
+Bits hashBytes(int hash, unsigned char *k, int len)
+{
+	assert(hash >= 0 && hash < NHASHES);
+	return fns[hash](k, len);
+}
+
+// Batches of keys are hashed side by side, HASHLANES at a time,
+//   each key in its own lane of a vector (GCC vector extensions),
+//   for HASH_JENKINS and HASH_XX, whose arithmetic is all on 32-bit
+//   words; HASH_WY needs 64x64->128 bit multiplies, which vectors
+//   don't have, so its keys are hashed one by one
+// - attribute values are mostly short words, so only keys which
+//   need no full round of the scalar loop (under 12 bytes for
+//   HASH_JENKINS, 16 for HASH_XX) go in lanes; any others in a
+//   batch are hashed one by one
+// - each key's bytes are loaded as two words, zero-padded as the
+//   scalar code pads them (with loads which stay inside the key),
+//   and placed in its lane; for HASH_XX, a lane whose key has
+//   fewer words or bytes than another's is masked, keeping its
+//   state unchanged for those steps
+// - the arithmetic is then exactly that of the scalar functions
+//   (the same macros, on vectors), so results are bit-identical
+// - kernels are compiled for AVX-512, AVX2 and baseline x86-64 (or
+//   just generically, elsewhere), and the best the CPU supports is
+//   picked when the program is loaded
+// On big-endian machines, all keys are hashed one by one
+
+#define HASHLANES 16
+
+typedef Bits Lanes __attribute__((vector_size(HASHLANES * sizeof(Bits))));
+
+// a vector, or its lanes
+typedef union {
+	Lanes v;
+	Bits  w[HASHLANES];
+} LaneSet;
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define KERNEL __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define KERNEL
+#endif
+
+static struct {
+	unsigned long long nkeys;    // keys hashed via hashBatch()
+	unsigned long long nlanes;   // of those, hashed in vector lanes
+} stats;
+
+// the first len (at most 16) bytes at k, zero-padded, as two
+//   little-endian words; reads no byte beyond k[len-1]
+
+static void loadKey(unsigned char *k, Count len, unsigned long long *lo,
+                    unsigned long long *hi)
+{
+	*hi = 0;
+	if (len >= 8) {
+		*lo = read64(k);
+		if (len > 8) *hi = read64(k + len - 8) >> (8 * (16 - len));
+	}
+	else if (len >= 4)
+		*lo = read32(k) | ((unsigned long long)read32(k + len - 4)
+		                   >> (8 * (8 - len)) << 32);
+	else {
+		*lo = 0;
+		for (Count j = 0; j < len; j++)
+			*lo |= (unsigned long long)k[j] << (8 * j);
+	}
+}
+
+// HASH_JENKINS on keys of under 12 bytes: with no full rounds, the
+//   hash is just the final mix of the initial state plus the
+//   zero-padded key (the lowest byte of c is reserved for the length)
+
+KERNEL
+static void jenkinsKernel(LaneSet *ka, LaneSet *kb, LaneSet *kc,
+                          LaneSet *out)
+{
+	Lanes a = ka->v + 0x9e3779b9, b = kb->v + 0x9e3779b9,
+	      c = kc->v + 3923095;
+	final(a, b, c);
+	out->v = c;
+}
+
+// HASH_XX on keys of under 16 bytes: words[r] holds each key's r'th
+//   4-byte word (zero-padded); a lane's whole words, then the bytes
+//   of its last part-word, are mixed in only as far as its length
+
+KERNEL
+static void xxKernel(LaneSet *len, LaneSet *words, LaneSet *out)
+{
+	Lanes l = len->v, h = l + XX5, tail = words[0].v;
+	for (Count r = 0; r < 3; r++) {
+		Lanes live = (Lanes)(l >= 4*(r+1));
+		Lanes nh = h + words[r].v * XX3;
+		nh = rotl32(nh, 17) * XX4;
+		h = (nh & live) | (h & ~live);
+		tail = (words[r+1].v & live) | (tail & ~live);
+	}
+	for (Count r = 0; r < 3; r++) {
+		Lanes live = (Lanes)((l & 3) > r);
+		Lanes nh = h + ((tail >> (8*r)) & 0xff) * XX5;
+		nh = rotl32(nh, 11) * XX1;
+		h = (nh & live) | (h & ~live);
+	}
+	h ^= h >> 15;
+	h *= XX2;
+	h ^= h >> 13;
+	h *= XX3;
+	h ^= h >> 16;
+	out->v = h;
+}
+
+// hash up to HASHLANES keys with HASH_JENKINS; returns how many
+//   were hashed in lanes
+
+static Count jenkinsLanes(unsigned char **keys, int *lens, Count n,
+                          Bits *out)
+{
+	LaneSet a, b, c, res;
+	Count nlanes = 0;
+	for (Count i = 0; i < HASHLANES; i++) {
+		unsigned long long lo = 0, hi = 0;
+		if (i < n && lens[i] < 12) {
+			loadKey(keys[i], lens[i], &lo, &hi);
+			nlanes++;
+		}
+		a.w[i] = lo;
+		b.w[i] = lo >> 32;
+		c.w[i] = hi << 8;
+	}
+	jenkinsKernel(&a, &b, &c, &res);
+	for (Count i = 0; i < n; i++)
+		out[i] = (lens[i] < 12) ? res.w[i] : hash_any(keys[i], lens[i]);
+	return nlanes;
+}
+
+// hash up to HASHLANES keys with HASH_XX; returns how many were
+//   hashed in lanes
+
+static Count xxLanes(unsigned char **keys, int *lens, Count n, Bits *out)
+{
+	LaneSet len, words[4], res;
+	Count nlanes = 0;
+	for (Count i = 0; i < HASHLANES; i++) {
+		unsigned long long lo = 0, hi = 0;
+		len.w[i] = 0;
+		if (i < n && lens[i] < 16) {
+			len.w[i] = lens[i];
+			loadKey(keys[i], lens[i], &lo, &hi);
+			nlanes++;
+		}
+		words[0].w[i] = lo;
+		words[1].w[i] = lo >> 32;
+		words[2].w[i] = hi;
+		words[3].w[i] = hi >> 32;
+	}
+	xxKernel(&len, words, &res);
+	for (Count i = 0; i < n; i++)
+		out[i] = (lens[i] < 16) ? res.w[i] : hash_xx(keys[i], lens[i]);
+	return nlanes;
+}
+
+// hash the n keys keys[i] (of lens[i] bytes) with hash function
+//   hash, into out[0..n); the same as n calls of hashBytes()
+// may be called by several threads at once
+
+void hashBatch(int hash, unsigned char **keys, int *lens, Count n,
+               Bits *out)
+{
+	assert(hash >= 0 && hash < NHASHES);
+	__atomic_add_fetch(&stats.nkeys, n, __ATOMIC_RELAXED);
+#ifndef WORDS_BIGENDIAN
+	if (hash == HASH_JENKINS || hash == HASH_XX) {
+		Count nlanes = 0;
+		for (Count i = 0; i < n; i += HASHLANES) {
+			Count m = (n - i < HASHLANES) ? n - i : HASHLANES;
+			if (hash == HASH_JENKINS)
+				nlanes += jenkinsLanes(keys+i, lens+i, m, out+i);
+			else
+				nlanes += xxLanes(keys+i, lens+i, m, out+i);
+		}
+		__atomic_add_fetch(&stats.nlanes, nlanes, __ATOMIC_RELAXED);
+		return;
+	}
+#endif
+	for (Count i = 0; i < n; i++)
+		out[i] = fns[hash](keys[i], lens[i]);
+}
+
+// display batch hashing counters for this process
+
+void hashStats()
+{
+	if (stats.nkeys == 0) return;
+	printf("Hash batches: %llu keys, %llu hashed in %d-key vectors\n",
+	       stats.nkeys, stats.nlanes, HASHLANES);
+}
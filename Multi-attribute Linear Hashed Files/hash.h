@@ -1,13 +1,30 @@
-// hash.h ... interface to hash function
+// hash.h ... interface to hash functions
 // part of Multi-attribute Linear-hashed Files
-// Hash function from PostgreSQL
+// Hash functions, one of which is used by each relation
+// See hash.c for details of the functions
 // Last modified by John Shepherd, July 2019
 
 #ifndef HASH_H
 #define HASH_H 1
 
+#include "defs.h"
 #include "bits.h"
 
+// hash function ids (stored in R.info)
+#define HASH_JENKINS 0  // from PostgreSQL (the original)
+#define HASH_WY      1  // wyhash-style 64-bit multiply/fold
+#define HASH_XX      2  // xxHash32
+#define NHASHES      3
+
+typedef Bits (*HashFn)(unsigned char *, int);
+
 Bits hash_any(unsigned char *, int);
+Bits hash_wy(unsigned char *, int);
+Bits hash_xx(unsigned char *, int);
+int hashId(char *);
+char *hashName(int);
+Bits hashBytes(int, unsigned char *, int);
+void hashBatch(int, unsigned char **, int *, Count, Bits *);
+void hashStats(void);
 
 #endif
@@ -0,0 +1,331 @@
+// hashbench.c ... time tuple hashing
+// part of Multi-attribute linear-hashed files
+// Reads tuples from stdin and hashes them repeatedly, as inserts
+//   do, to show how many tuple hashes can be made per second
+// Usage:  ./hashbench  [-n N]  RelName
+// where -n N is the number of hashes to time (default: 1000000)
+// Hashes are made with tupleHash(), and with every attribute
+//   hashed and the choice vector followed bit by bit (as
+//   tupleHash() once did), for comparison; a choice
+//   vector which uses only some attributes is where they differ;
+//   and with tupleHashes(), which hashes batches of tuples at once
+// The original tupleHash() is also timed, on the tuples' text: it
+//   copied every value into a malloc'd array, hashed them all, and
+//   printed a debug line per hash (here to /dev/null, and the
+//   copies are freed rather than leaked)
+// Then each hash function (see hash.c) is timed in the same way,
+//   as is hashing the tuples' values alone, one at a time and in
+//   batches (see hashBatch()); and the tuples' hashes under it are
+//   shared out among as many
+//   buckets as the relation's split policy would give them, to
+//   show how evenly it spreads these tuples; for each function:
+// - max: most tuples in a bucket, against the mean
+// - empty: buckets with no tuples
+// - chi2/df: the chi-squared statistic over the buckets, divided
+//   by its degrees of freedom; near 1 for a uniform spread, higher
+//   if tuples bunch up (an unsplit bucket is expected to get
+//   twice as many as a split one)
+
+#include <time.h>
+#include "defs.h"
+#include "reln.h"
+#include "tuple.h"
+#include "chvec.h"
+#include "bits.h"
+#include "hash.h"
+#include "util.h"
+#include "page.h"
+
+#define USAGE "./hashbench  [-n N]  RelName"
+
+// hash t from the hashes of all of its values, placing their bits
+//   one at a time (as tupleHash() once did)
+
+static Bits everyAttrHash(Reln r, Tuple t)
+{
+	Bits vals[MAXCHVEC];
+	for (Count i = 0; i < nattrs(r); i++)
+		vals[i] = attrHash(r, t, i);
+	ChVecItem *cv = chvec(r);
+	Bits hash = 0;
+	for (Count j = 0; j < MAXCHVEC; j++)
+		if (bitIsSet(vals[cv[j].att], cv[j].bit))
+			hash = setBit(hash, j);
+	return hash;
+}
+
+// hash t as tupleHash() would if r used hash function benchHash
+
+static int benchHash;
+
+static Bits withHash(Reln r, Tuple t)
+{
+	Bits vals[MAXCHVEC];
+	Count used = hashedAttrs(r);
+	for (Count i = 0; used != 0; i++, used >>= 1)
+		if (used & 1) vals[i] = attrHashWith(benchHash, textIntHash(r), t, i);
+	return cvHash(chvecMap(r), vals);
+}
+
+// tupleHash() as it was, on tuple text t
+
+static FILE *sink;  // where its debug lines go
+
+static Bits oldTupleHash(Reln r, Tuple t)
+{
+	char buf[MAXBITS+1];
+	Count nvals = nattrs(r);
+	char **vals = malloc(nvals*sizeof(char *));
+	assert(vals != NULL);
+	char *c = t, *c0 = t;
+	int i = 0;
+	for (;;) {
+		while (*c != ',' && *c != '\0') c++;
+		if (*c == '\0') {
+			vals[i++] = copyString(c0);
+			break;
+		}
+		*c = '\0';
+		vals[i++] = copyString(c0);
+		*c = ',';
+		c++; c0 = c;
+	}
+	Bits hash = 0;
+	Bits val_hash[MAXBITS+1];
+	for (i = 0; i < nvals; i++)
+		val_hash[i] = hash_any((unsigned char *)vals[i],strlen(vals[i]));
+	ChVecItem *cv = chvec(r);
+	for (int j = 0; j < MAXCHVEC; j++)
+		if (bitIsSet(val_hash[cv[j].att], cv[j].bit))
+			hash = setBit(hash, j);
+	bitsString(hash,buf);
+	fprintf(sink, "hash(%s) = %s\n", vals[0], buf);
+	for (i = 0; i < nvals; i++) free(vals[i]);
+	free(vals);
+	return hash;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// make n hashes of the tuples in ts (cycling through them) with
+//   hash(), and show how fast it was; returns the xor of all hashes
+
+static Bits timeHashes(char *name, Bits (*hash)(Reln, Tuple), Reln r,
+                       Tuple *ts, Count ntups, Count n)
+{
+	Bits x = 0;
+	double start = now();
+	for (Count i = 0; i < n; i++)
+		x ^= hash(r, ts[i % ntups]);
+	double secs = now() - start;
+	printf("%-16s %u hashes in %.3fs: %10.0f hashes/sec\n",
+	       name, n, secs, secs > 0 ? n / secs : 0);
+	return x;
+}
+
+// as timeHashes(), but hashing HASHBATCH tuples at a time
+
+static Bits timeBatches(Reln r, Tuple *ts, Count ntups, Count n)
+{
+	Bits x = 0, hs[HASHBATCH];
+	Tuple batch[HASHBATCH];
+	double start = now();
+	for (Count i = 0; i < n; i += HASHBATCH) {
+		Count m = (n - i < HASHBATCH) ? n - i : HASHBATCH;
+		for (Count k = 0; k < m; k++) batch[k] = ts[(i+k) % ntups];
+		tupleHashes(r, batch, m, hs);
+		for (Count k = 0; k < m; k++) x ^= hs[k];
+	}
+	double secs = now() - start;
+	printf("%-16s %u hashes in %.3fs: %10.0f hashes/sec\n",
+	       "tupleHashes", n, secs, secs > 0 ? n / secs : 0);
+	return x;
+}
+
+// hash n of the nkeys values in keys[] (cycling through them) with
+//   hash function fn, one at a time and then in batches, and show
+//   how fast each was
+
+#define VALBATCH 1024
+
+static void timeValues(int fn, unsigned char **keys, int *lens,
+                       Count nkeys, Count n)
+{
+	Bits x1 = 0, x2 = 0, hs[VALBATCH];
+	double start = now();
+	for (Count i = 0; i < n; i++)
+		x1 ^= hashBytes(fn, keys[i % nkeys], lens[i % nkeys]);
+	double one = now() - start;
+	start = now();
+	for (Count i = 0; i < n; ) {
+		Count o = i % nkeys;
+		Count m = n - i;
+		if (m > VALBATCH) m = VALBATCH;
+		if (m > nkeys - o) m = nkeys - o;
+		hashBatch(fn, keys+o, lens+o, m, hs);
+		for (Count k = 0; k < m; k++) x2 ^= hs[k];
+		i += m;
+	}
+	double batched = now() - start;
+	if (x1 != x2) fatal("Batched hashes differ");
+	printf("%-16s values: %10.0f/sec one at a time, %10.0f/sec in batches\n",
+	       "", one > 0 ? n / one : 0, batched > 0 ? n / batched : 0);
+}
+
+// Main ... process args, read tuples, time hashes
+
+int main(int argc, char **argv)
+{
+	Reln r;  // handle on the open relation
+	char err[MAXERRMSG];  // buffer for error messages
+	char *rname;  // name of table/file
+	int nhashes;  // hashes to time
+
+	// process command-line args
+
+	if (argc < 2) fatal(USAGE);
+	nhashes = 1000000;
+	int a;
+	for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+		if (strcmp(argv[a], "-n") == 0 && a+1 < argc) {
+			nhashes = atoi(argv[++a]);
+			if (nhashes < 1) fatal(USAGE);
+		}
+		else
+			fatal(USAGE);
+	}
+	if (a >= argc) fatal(USAGE);
+	rname = argv[a];
+
+	if (!existsRelation(rname)) {
+		sprintf(err, "No such relation: %s",rname);
+		fatal(err);
+	}
+	if ((r = openRelation(rname,"r")) == NULL) {
+		sprintf(err, "Can't open relation: %s",rname);
+		fatal(err);
+	}
+
+	// read tuples into memory
+
+	Count ntups = 0, size = 1024;
+	char *bufs = malloc(size * MAXTUPBYTES);
+	assert(bufs != NULL);
+	Input in = openInput(stdin);
+	while (scanTuple(r, in, bufs + ntups*MAXTUPBYTES) != NULL) {
+		if (++ntups == size) {
+			size *= 2;
+			bufs = realloc(bufs, size * MAXTUPBYTES);
+			assert(bufs != NULL);
+		}
+	}
+	closeInput(in);
+	if (ntups == 0) fatal("No tuples to hash");
+	Tuple *ts = malloc(ntups * sizeof(Tuple));
+	assert(ts != NULL);
+	for (Count i = 0; i < ntups; i++) ts[i] = bufs + i*MAXTUPBYTES;
+	char **lines = malloc(ntups * sizeof(char *));
+	assert(lines != NULL);
+	for (Count i = 0; i < ntups; i++) {
+		char buf[MAXTUPLEN];
+		tupleString(ts[i], buf);
+		lines[i] = copyString(buf);
+	}
+
+	// time each way of hashing
+
+	Count used = hashedAttrs(r), nused = 0;
+	for (Count i = 0; i < nattrs(r); i++) nused += (used >> i) & 1;
+	printf("%u tuples, %u attributes, %u used by choice vector\n",
+	       ntups, nattrs(r), nused);
+	if ((sink = fopen("/dev/null", "w")) == NULL)
+		fatal("Can't open /dev/null");
+	Bits x0 = timeHashes("old tupleHash", oldTupleHash, r, lines, ntups,
+	                     nhashes);
+	fclose(sink);
+	Bits x1 = timeHashes("every attribute", everyAttrHash, r, ts, ntups,
+	                     nhashes);
+	Bits x2 = timeHashes("tupleHash", tupleHash, r, ts, ntups, nhashes);
+	Bits x3 = timeBatches(r, ts, ntups, nhashes);
+	// (the old tupleHash() only ever used the original hash function,
+	//   and hashed ints as text)
+	if (x1 != x2 || x2 != x3
+	    || (relationHash(r) == HASH_JENKINS && textIntHash(r) && x0 != x1))
+		fatal("Hashes differ");
+
+	// the values which are hashed, as hashed (ints as text, or as
+	//   their bytes; see attrHashWith())
+
+	Count nkeys = ntups * nused;
+	unsigned char **keys = malloc(nkeys * sizeof(unsigned char *));
+	int *lens = malloc(nkeys * sizeof(int));
+	char (*texts)[16] = malloc(nkeys * sizeof(*texts));
+	assert(keys != NULL && lens != NULL && texts != NULL);
+	Count k = 0;
+	for (Count i = 0; i < ntups; i++) {
+		for (Count v = 0; v < nattrs(r); v++) {
+			if (!((used >> v) & 1)) continue;
+			Count len;
+			if (textIntHash(r) && tupleIsInt(ts[i], v)) {
+				len = sprintf(texts[k], "%d", tupleInt(ts[i], v));
+				keys[k] = (unsigned char *)texts[k];
+			}
+			else
+				keys[k] = (unsigned char *)tupleAttr(ts[i], v, &len);
+			lens[k++] = len;
+		}
+	}
+
+	// compare hash functions, on speed and spread
+
+	unsigned long long nbytes = 0;
+	for (Count i = 0; i < ntups; i++) nbytes += tupleSpace(ts[i]);
+	Count nb = relationTarget(r, ntups, nbytes);
+	Count d = 0;
+	while ((2u << d) <= nb) d++;
+	Offset sp = nb - (1u << d);
+	Count *counts = malloc(nb * sizeof(Count));
+	assert(counts != NULL);
+	printf("%u buckets (depth %u, sp %u), mean %.1f tuples\n",
+	       nb, d, sp, (double)ntups / nb);
+	for (benchHash = 0; benchHash < NHASHES; benchHash++) {
+		timeHashes(hashName(benchHash), withHash, r, ts, ntups, nhashes);
+		timeValues(benchHash, keys, lens, nkeys, nhashes);
+		memset(counts, 0, nb * sizeof(Count));
+		for (Count i = 0; i < ntups; i++) {
+			Bits h = withHash(r, ts[i]);
+			PageID b = getLower(h, d);
+			if (b < sp) b = getLower(h, d+1);
+			counts[b]++;
+		}
+		Count max = 0, nempty = 0;
+		double chi2 = 0;
+		for (PageID b = 0; b < nb; b++) {
+			// split buckets (and their buddies) cover half the hashes
+			double share = (b < sp || b >= (1u << d)) ? 0.5 : 1.0;
+			double expect = (double)ntups * share / (1u << d);
+			double diff = counts[b] - expect;
+			chi2 += diff * diff / expect;
+			if (counts[b] > max) max = counts[b];
+			if (counts[b] == 0) nempty++;
+		}
+		printf("%-16s max %u, %u empty, chi2/df %.2f\n", "",
+		       max, nempty, nb > 1 ? chi2 / (nb-1) : 0);
+	}
+	free(counts);
+	hashStats();
+	free(texts);
+	free(lens);
+	free(keys);
+	for (Count i = 0; i < ntups; i++) free(lines[i]);
+	free(lines);
+	free(ts);
+	free(bufs);
+	closeRelation(r);
+	return 0;
+}
@@ -0,0 +1,202 @@
+// ingest.c ... parallel insertion
+// part of Multi-attribute Linear-hashed Files
+// Inserts tuples from a file into a relation using several threads
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "defs.h"
+#include "ingest.h"
+#include "reln.h"
+#include "tuple.h"
+#include "bits.h"
+
+// The calling thread reads and hashes the tuples, and hands each
+//   one to one of N worker threads (N a power of two), which insert
+//   them with addHashedToRelation()
+// - a tuple goes to the worker given by the lowest log2(N) bits of
+//   its hash; once the relation's depth is at least log2(N), all
+//   tuples in a bucket agree in those bits, so each worker owns a
+//   disjoint set of buckets (and their overflow chains), and both
+//   halves of a split bucket stay with the same worker
+// - workers only meet at bucket latches (see reln.c): while the
+//   relation is still shallower than that, and when one worker's
+//   split has to wait for an insert to finish
+// - each worker has a ring of tuples with one producer (the
+//   reader) and one consumer (the worker); each advances its own
+//   end of the ring with an atomic store, so neither takes a lock
+// - tuples are parsed straight from the input (see input.c), and
+//   copied into a slot of the ring, so none is allocated
+// - a reader with a full ring, or a worker with an empty one,
+//   backs off by yielding, then by sleeping
+// Commits (every group tuples, if group > 0) are made by the
+//   reading thread, once every ring has drained, so that a commit
+//   covers exactly the tuples read so far; the workers sit idle
+//   while it is made (see commitRelation())
+
+#define RINGSIZE 1024   // tuples per ring (a power of two)
+#define NSPINS   64     // yields before backing off to sleeps
+#define NAPTIME  50000  // nanoseconds per sleep
+
+typedef struct {
+	unsigned long head;  // next tuple to insert (set by worker)
+	char   tuples[RINGSIZE][MAXTUPBYTES];
+	Bits   hashes[RINGSIZE];
+	unsigned long tail;  // next free slot (set by reader)
+	Bool   done;         // no more tuples will be added
+	Reln   reln;
+	Bool   verbose;      // show where each tuple went
+	Count  ninserted;    // tuples inserted by worker
+	Count  idle;         // times worker found ring empty
+	pthread_t thread;
+} Ring;
+
+static struct {
+	Count nthreads;  // workers used
+	Count ntuples;   // tuples read
+	Count full;      // times reader found a ring full
+	Count drains;    // times reader waited for rings to drain
+	Count idle;      // times workers found their ring empty
+	Count least;     // fewest tuples inserted by a worker
+	Count most;      // most tuples inserted by a worker
+} stats;
+
+static void backoff(Count *spins)
+{
+	if (++*spins < NSPINS)
+		sched_yield();
+	else {
+		struct timespec nap = { 0, NAPTIME };
+		nanosleep(&nap, NULL);
+	}
+}
+
+static void *worker(void *arg)
+{
+	Ring *q = arg;
+	Count spins = 0;
+	char tup[MAXTUPLEN];
+	char err[MAXTUPLEN+MAXERRMSG];
+	for (;;) {
+		unsigned long head = q->head;
+		if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+			// (the reader sets done only after adding its last tuple)
+			if (__atomic_load_n(&q->done, __ATOMIC_ACQUIRE)
+			    && head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+				break;
+			q->idle++;
+			backoff(&spins);
+			continue;
+		}
+		spins = 0;
+		Tuple t = q->tuples[head % RINGSIZE];
+		PageID pid = addHashedToRelation(q->reln, t,
+		                                 q->hashes[head % RINGSIZE]);
+		if (pid == NO_PAGE || q->verbose) tupleString(t, tup);
+		// (t's slot may be reused as soon as this is done)
+		__atomic_store_n(&q->head, head+1, __ATOMIC_RELEASE);
+		if (pid == NO_PAGE) {
+			sprintf(err, "Insert of %s failed\n", tup);
+			fatal(err);
+		}
+		if (q->verbose) printf("%s -> %d\n", tup, pid);
+		q->ninserted++;
+	}
+	return NULL;
+}
+
+// wait until each worker has inserted every tuple handed to it
+// (a worker only moves its ring's head on once an insert is done)
+
+static void drain(Ring *rings, Count n)
+{
+	for (Count i = 0; i < n; i++) {
+		Count spins = 0;
+		while (__atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE)
+		       != rings[i].tail) {
+			stats.drains++;
+			backoff(&spins);
+		}
+	}
+}
+
+// insert tuples from in (one per line, as for insert) into r,
+//   using nthreads workers (rounded down to a power of two)
+// commits after every group tuples, if group > 0, with all of
+//   those tuples (and no others) inserted
+// returns the number of tuples inserted
+
+Count ingestRelation(Reln r, FILE *in, Count nthreads, Count group,
+                     Bool verbose)
+{
+	Count k = 0;
+	while ((2u << k) <= nthreads && (2u << k) <= MAXINGEST) k++;
+	Count n = 1u << k;
+	Ring *rings = calloc(n, sizeof(Ring));
+	assert(rings != NULL);
+	for (Count i = 0; i < n; i++) {
+		rings[i].reln = r;
+		rings[i].verbose = verbose;
+		int ok = pthread_create(&rings[i].thread, NULL, worker, &rings[i]);
+		assert(ok == 0);
+	}
+
+	// read and hash tuples, and pass them to their workers
+
+	Input input = openInput(in);
+	char buf[MAXTUPBYTES];
+	Tuple t;
+	Count ntuples = 0;
+	while ((t = scanTuple(r, input, buf)) != NULL) {
+		Bits h = tupleHash(r, t);
+		Ring *q = &rings[(k == 0) ? 0 : getLower(h, k)];
+		unsigned long tail = q->tail;
+		Count spins = 0;
+		while (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)
+		       == RINGSIZE) {
+			stats.full++;
+			backoff(&spins);
+		}
+		memcpy(q->tuples[tail % RINGSIZE], t, tupLength(t));
+		q->hashes[tail % RINGSIZE] = h;
+		__atomic_store_n(&q->tail, tail+1, __ATOMIC_RELEASE);
+		ntuples++;
+		if (group > 0 && ntuples % group == 0) {
+			drain(rings, n);
+			commitRelation(r);
+		}
+	}
+	closeInput(input);
+
+	// let workers finish
+
+	Count ninserted = 0;
+	stats.least = ntuples;
+	stats.most = 0;
+	for (Count i = 0; i < n; i++) {
+		__atomic_store_n(&rings[i].done, TRUE, __ATOMIC_RELEASE);
+		pthread_join(rings[i].thread, NULL);
+		ninserted += rings[i].ninserted;
+		stats.idle += rings[i].idle;
+		if (rings[i].ninserted < stats.least)
+			stats.least = rings[i].ninserted;
+		if (rings[i].ninserted > stats.most)
+			stats.most = rings[i].ninserted;
+	}
+	free(rings);
+	stats.nthreads = n;
+	stats.ntuples = ntuples;
+	return ninserted;
+}
+
+// display parallel insertion counters for this process
+
+void ingestStats()
+{
+	if (stats.nthreads == 0) return;
+	printf("Ingest: %u tuples, %u workers (%u to %u tuples each), "
+	       "reader waited %u times (%u to commit), "
+	       "workers idle %u times\n",
+	       stats.ntuples, stats.nthreads, stats.least, stats.most,
+	       stats.full + stats.drains, stats.drains, stats.idle);
+}
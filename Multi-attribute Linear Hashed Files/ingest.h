@@ -0,0 +1,17 @@
+// ingest.h ... interface to parallel insertion
+// part of Multi-attribute Linear-hashed Files
+// See ingest.c for details of how tuples are shared out
+
+#ifndef INGEST_H
+#define INGEST_H 1
+
+#include "defs.h"
+#include "reln.h"
+
+// most worker threads used (any more are ignored)
+#define MAXINGEST 64
+
+Count ingestRelation(Reln, FILE *, Count, Count, Bool);
+void ingestStats(void);
+
+#endif
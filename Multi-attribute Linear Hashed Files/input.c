@@ -0,0 +1,142 @@
+// input.c ... buffered line input
+// part of Multi-attribute Linear-hashed Files
+// Hands out the lines of a file without copying them one by one
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include "defs.h"
+#include "input.h"
+
+// Lines are handed out as views (start, length) of a block of the
+//   input, valid until the next call; they are not '\0'-terminated
+//   and don't include their '\n'
+// - a regular file is mapped into memory whole, so its lines are
+//   never copied at all
+// - anything else (a pipe, a terminal) is read up to INPUTBLOCK
+//   bytes at a time, taking whatever has arrived so far, so lines
+//   are handed out as soon as they are written; a line split by
+//   the end of a block is moved to the start of the buffer before
+//   the next block is read after it; the buffer never grows, so a
+//   line with no '\n' in sight can't use up memory: once it is
+//   longer than MAXLINE chars, its first MAXLINE chars are kept
+//   aside and handed out, and the rest of it is skipped
+// Line ends are found with memchr(), which the C library does a
+//   word or vector at a time rather than byte by byte
+// Input starts at the current position of the file's descriptor,
+//   so nothing should have been read from the file via stdio, nor
+//   be read by other means while it is open
+
+struct InputRep {
+	FILE  *file;
+	char  *map;    // whole file, if mapped (else NULL)
+	size_t maplen;
+	char  *buf;    // block buffer, if not mapped
+	size_t size;   // bytes allocated for buf
+	char  *next;   // first byte not yet handed out
+	char  *end;    // just past last byte available
+	Bool   eof;    // no more to read into buf
+	char   cut[MAXLINE];  // start of an over-long line, if not mapped
+};
+
+Input openInput(FILE *f)
+{
+	Input in = malloc(sizeof(struct InputRep));
+	assert(in != NULL);
+	in->file = f;
+	in->map = in->buf = NULL;
+	in->maplen = in->size = 0;
+	in->eof = FALSE;
+	struct stat st;
+	off_t pos = lseek(fileno(f), 0, SEEK_CUR);
+	if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)
+	    && pos >= 0 && pos < st.st_size) {
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+		               fileno(f), 0);
+		if (m != MAP_FAILED) {
+			madvise(m, st.st_size, MADV_SEQUENTIAL);
+			in->map = m;
+			in->maplen = st.st_size;
+			in->next = in->map + pos;
+			in->end = in->map + st.st_size;
+			in->eof = TRUE;
+			return in;
+		}
+	}
+	in->size = INPUTBLOCK;
+	in->buf = malloc(in->size);
+	assert(in->buf != NULL);
+	in->next = in->end = in->buf;
+	return in;
+}
+
+// give up input (leaving the file open)
+
+void closeInput(Input in)
+{
+	if (in->map != NULL) {
+		// leave the file positioned after what was handed out
+		fseek(in->file, in->next - in->map, SEEK_SET);
+		munmap(in->map, in->maplen);
+	}
+	free(in->buf);
+	free(in);
+}
+
+// read another block into the buffer, after the unread bytes
+
+static void refill(Input in)
+{
+	size_t left = in->end - in->next;
+	assert(left < in->size);
+	memmove(in->buf, in->next, left);
+	ssize_t n;
+	do
+		n = read(fileno(in->file), in->buf + left, in->size - left);
+	while (n < 0 && errno == EINTR);
+	if (n < 0) fatal("Can't read input");
+	if (n == 0) in->eof = TRUE;
+	in->next = in->buf;
+	in->end = in->buf + left + n;
+}
+
+// hand out the first MAXLINE chars of an over-long line, and skip
+//   the rest of it (up to and including its '\n')
+
+static char *cutLine(Input in, Count *len)
+{
+	memcpy(in->cut, in->next, MAXLINE);
+	in->next = in->end;
+	while (!in->eof) {
+		refill(in);
+		char *nl = memchr(in->next, '\n', in->end - in->next);
+		if (nl != NULL) { in->next = nl+1; break; }
+		in->next = in->end;
+	}
+	*len = MAXLINE;
+	return in->cut;
+}
+
+// next line of input; sets *len to its length
+// (or to MAXLINE if it is longer, and input is not mapped)
+// returns NULL at end of input
+
+char *nextLine(Input in, Count *len)
+{
+	char *nl;
+	while ((nl = memchr(in->next, '\n', in->end - in->next)) == NULL) {
+		if (in->eof) {
+			// last line, with no '\n'
+			if (in->next == in->end) return NULL;
+			nl = in->end;
+			break;
+		}
+		if (in->end - in->next > MAXLINE) return cutLine(in, len);
+		refill(in);
+	}
+	char *line = in->next;
+	*len = nl - line;
+	in->next = (nl < in->end) ? nl+1 : nl;
+	return line;
+}
@@ -0,0 +1,24 @@
+// input.h ... interface to buffered line input
+// part of Multi-attribute Linear-hashed Files
+// See input.c for details of how input is read
+
+#ifndef INPUT_H
+#define INPUT_H 1
+
+typedef struct InputRep *Input;
+
+#include "defs.h"
+
+// bytes read at a time, if input is not mapped
+#define INPUTBLOCK (1024*1024)
+
+// longest line handed out whole, if input is not mapped; longer
+//   lines are cut short to MAXLINE chars (longer than any tuple's
+//   text, so they are still rejected) and the rest is skipped
+#define MAXLINE MAXTUPLEN
+
+Input openInput(FILE *);
+void closeInput(Input);
+char *nextLine(Input, Count *);
+
+#endif
@@ -1,33 +1,111 @@
 // insert.c ... add tuples to a relation
 // part of Multi-attribute linear-hashed files
 // Reads tuples from stdin and inserts into Reln
-// Usage:  ./insert  [-v]  RelName
+// Usage:  ./insert  [-v]  [-d]  [-b]  [-j N]  [-n N]  [-c N]  [-s none|commit]  RelName
+// where -d uses direct I/O for pages (bypassing the OS cache)
+// and -b splits buckets in a background thread
+// and -j N inserts using N threads (see ingest.c)
+// and -n N inserts N tuples at a time (see addTuplesToRelation())
+// and -c N commits after every N tuples (default: only at end)
+// and -s chooses whether commits sync the log (default: commit)
 // Last modified by John Shepherd, July 2019
 
 #include "defs.h"
 #include "reln.h"
 #include "tuple.h"
+#include "buf.h"
+#include "codec.h"
+#include "wal.h"
+#include "fsm.h"
+#include "split.h"
+#include "ingest.h"
+#include "hash.h"
 
-#define USAGE "./insert  [-v]  RelName"
+#define USAGE "./insert  [-v]  [-d]  [-b]  [-j N]  [-n N]  [-c N]  [-s none|commit]  RelName"
+
+// read stdin and insert tuples into r, n at a time
+// (batches end at commit points, so commits come every group tuples;
+//   and tuples aren't shown, as batches don't say where they went)
+
+static Count insertBatches(Reln r, Input in, int n, int group)
+{
+	Tuple *ts = malloc(n * sizeof(Tuple));
+	char *bufs = malloc((size_t)n * MAXTUPBYTES);
+	assert(ts != NULL && bufs != NULL);
+	Count ninserted = 0;
+	for (;;) {
+		Count max = n;
+		if (group > 0 && group - ninserted % group < max)
+			max = group - ninserted % group;
+		Count k = 0;
+		while (k < max
+		       && (ts[k] = scanTuple(r, in, bufs + k*MAXTUPBYTES)) != NULL)
+			k++;
+		if (k == 0) break;
+		addTuplesToRelation(r, ts, k);
+		ninserted += k;
+		if (group > 0 && ninserted % group == 0) commitRelation(r);
+	}
+	free(bufs);
+	free(ts);
+	return ninserted;
+}
 
 // Main ... process args, read/insert tuples
 
 int main(int argc, char **argv)
 {
 	Reln r;  // handle on the open relation
-	Tuple t;  // tuple buffer
+	Tuple t;  // tuple, parsed into buf
+	char buf[MAXTUPBYTES];  // buffer for tuples
 	char err[2*MAXERRMSG];  // buffer for error messages
 	char tup[MAXTUPLEN];  // buffer for printable tuples
 	int verbose;  // show extra info on query progress
+	int direct;   // use direct I/O
+	int background;  // split buckets in background
+	int nthreads; // threads inserting tuples (0 = just this one)
+	int batch;    // tuples per batch (0 = one at a time)
 	char *rname;  // name of table/file
+	int group;    // tuples per commit (0 = commit only at end)
+	int sync;     // sync policy for commits
 
 	// process command-line args
 
 	if (argc < 2) fatal(USAGE);
-    if (strcmp(argv[1], "-v") == 0)
-		{ verbose = 1; rname = argv[2]; }
-	else
-		{ verbose = 0; rname = argv[1]; }
+	verbose = direct = background = nthreads = batch = group = 0;
+	sync = WAL_SYNC_COMMIT;
+	int a;
+	for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-d") == 0)
+			direct = 1;
+		else if (strcmp(argv[a], "-b") == 0)
+			background = 1;
+		else if (strcmp(argv[a], "-j") == 0 && a+1 < argc) {
+			nthreads = atoi(argv[++a]);
+			if (nthreads < 1) fatal(USAGE);
+		}
+		else if (strcmp(argv[a], "-n") == 0 && a+1 < argc) {
+			batch = atoi(argv[++a]);
+			if (batch < 1) fatal(USAGE);
+		}
+		else if (strcmp(argv[a], "-c") == 0 && a+1 < argc)
+			group = atoi(argv[++a]);
+		else if (strcmp(argv[a], "-s") == 0 && a+1 < argc) {
+			a++;
+			if (strcmp(argv[a], "none") == 0)
+				sync = WAL_SYNC_NONE;
+			else if (strcmp(argv[a], "commit") == 0)
+				sync = WAL_SYNC_COMMIT;
+			else
+				fatal(USAGE);
+		}
+		else
+			fatal(USAGE);
+	}
+	if (a >= argc) fatal(USAGE);
+	rname = argv[a];
 
 
 	// set up relation for writing
@@ -40,25 +118,40 @@ int main(int argc, char **argv)
 		sprintf(err, "Can't open relation: %s",argv[1]);
 		fatal(err);
 	}
+	if (direct && useDirectIO(r) != OK)
+		fprintf(stderr, "Direct I/O not supported for %s\n", rname);
+	setSyncPolicy(r, sync);
+	if (background) setBackgroundSplits(r, TRUE);
 
 	// read stdin and insert tuples
 
-	while ((t = readTuple(r,stdin)) != NULL) {
-		PageID pid;
-		pid = addToRelation(r,t);
-
-		tupleString(t,tup); // printable version
-		if (pid == NO_PAGE) {
-			sprintf(err, "Insert of %s failed\n", tup);
-			fatal(err);
+	Count ninserted = 0;
+	if (nthreads > 0)
+		ninserted = ingestRelation(r, stdin, nthreads, group, verbose);
+	else {
+		Input in = openInput(stdin);
+		if (batch > 0)
+			ninserted = insertBatches(r, in, batch, group);
+		while (batch == 0 && (t = scanTuple(r,in,buf)) != NULL) {
+			PageID pid;
+			pid = addToRelation(r,t);
+
+			tupleString(t,tup); // printable version
+			if (pid == NO_PAGE) {
+				sprintf(err, "Insert of %s failed\n", tup);
+				fatal(err);
+			}
+			if (verbose) printf("%s -> %d\n",tup,pid);
+			ninserted++;
+			if (group > 0 && ninserted % group == 0) commitRelation(r);
 		}
-		if (verbose) printf("%s -> %d\n",tup,pid);
-		free(t);
+		closeInput(in);
 	}
 
 	// clean up
 
 	closeRelation(r);
+	if (verbose) { bufStats(); codecStats(); walStats(); fsmStats(); splitStats(); ingestStats(); hashStats(); }
 
 	return 0;
 }
@@ -0,0 +1,71 @@
+// load.c ... bulk load tuples into an empty relation
+// part of Multi-attribute linear-hashed files
+// Reads tuples from stdin and builds Reln from them in one pass
+// Usage:  ./load  [-v]  [-m MB]  RelName
+// where -m MB is the memory to use for tuples before spilling
+//   them to temporary files (default: 256)
+
+#include "defs.h"
+#include "reln.h"
+#include "bulk.h"
+#include "buf.h"
+#include "codec.h"
+#include "hash.h"
+
+#define USAGE "./load  [-v]  [-m MB]  RelName"
+
+// Main ... process args, load tuples
+
+int main(int argc, char **argv)
+{
+	Reln r;  // handle on the open relation
+	char err[2*MAXERRMSG];  // buffer for error messages
+	int verbose;  // show extra info on load progress
+	size_t memlimit;  // bytes of tuples held in memory
+	char *rname;  // name of table/file
+
+	// process command-line args
+
+	if (argc < 2) fatal(USAGE);
+	verbose = 0;
+	memlimit = LOAD_MEMORY;
+	int a;
+	for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-m") == 0 && a+1 < argc) {
+			int mb = atoi(argv[++a]);
+			if (mb < 1) fatal(USAGE);
+			memlimit = (size_t)mb*1024*1024;
+		}
+		else
+			fatal(USAGE);
+	}
+	if (a >= argc) fatal(USAGE);
+	rname = argv[a];
+
+	// set up relation for writing
+
+	if (!existsRelation(rname)) {
+		sprintf(err, "No such relation: %s", rname);
+		fatal(err);
+	}
+	if ((r = openRelation(rname,"r+")) == NULL) {
+		sprintf(err, "Can't open relation: %s", rname);
+		fatal(err);
+	}
+
+	// build relation from stdin
+
+	if (loadRelation(r, stdin, memlimit) != OK) {
+		sprintf(err, "Relation %s is not empty; use ./insert", rname);
+		fatal(err);
+	}
+
+	// clean up
+
+	closeRelation(r);
+	if (verbose) { loadStats(); bufStats(); codecStats(); hashStats(); }
+
+	return 0;
+}
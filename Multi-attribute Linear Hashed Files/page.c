@@ -3,8 +3,17 @@
 // Reading/writing pages into buffers and manipulating contents
 // Last modified by John Shepherd, July 2019
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "defs.h"
 #include "page.h"
+#include "reln.h"
+#include "buf.h"
+#include "codec.h"
+#include "fsm.h"
 
 // internal representation of pages
 struct PageRep {
@@ -14,91 +23,520 @@ struct PageRep {
 	char data[1];  // start of data
 };
 
-// A Page is a chunk of memory containing PAGESIZE bytes
+// A Page is a chunk of memory containing pagesize bytes
+// (pagesize is fixed for each file; see attachFile())
 // It is implemented as a struct (free, ovflow, data[1])
-// - free is the offset of the first byte of free space
+// - free is the offset within data[] of the most recently added
+//   tuple; tuples are added from the end of the page downwards
 // - ovflow is the page id of the next overflow page in bucket
-// - data[] is a sequence of bytes containing tuples
-// - each tuple is a sequence of chars terminated by '\0'
+// - data[] starts with a slot directory, growing upwards;
+//   slot i holds the offset and length of tuple i in data[]
+//   (so tuple i can be found without scanning tuples 0..i-1),
+//   and the tuple's hash (see tupleHash()), so that splits and
+//   scans can tell where a tuple belongs without reading it
+// - each tuple is a binary record (see tuple.c), whose length
+//   is known from the tuple itself
 // - PageID values count # pages from start of file
+// Free space lies between the last slot and data[free]
+// Older relations have other layouts; upgradePage() converts
+// - format 0: tuples packed from the start of data[], no slots
+// - format 1: as format 0, plus slots growing down from page end
+// - formats 0..4: tuples are '\0'-terminated text
+// - formats 1..7: slots hold no hash
+// Pages returned by getPage() live in the shared buffer pool (buf.c)
+// - putPage() marks the page dirty and gives it back to the pool
+// - releasePage() gives back a page that was not modified
+// - pages are written to file when evicted or at closeRelation()
+// Files opened read-only may instead be memory-mapped (mapFile())
+// - getPage() then returns a pointer straight into the mapping
+// - releasePage() on such a page does nothing
+// - pages beyond the end of the mapping still go via the pool
+// New pages are created in the pool by addPage(), which hands out
+//   PageIDs from a per-file counter; they reach the file later,
+//   like any other dirty page
+// appendPage() instead writes a finished page at the end of the
+//   file at once; it is meant for building a whole file in order
+// A file may have a compression codec (see buf.c and codec.c)
+// - pages are compressed/expanded as they move to/from the pool
+// - so such files can not be memory-mapped
+// A file may have a write-ahead log (see buf.c and wal.c)
+// A file may have a free-space map (see fsm.c), which is updated
+//   whenever one of its pages is written by putPage(), addPage()
+//   or appendPage()
 
-// create a new initially empty page in memory
-Page newPage()
+#define MAXFILES 8
+
+// files which hold pages
+static struct {
+	FILE  *file;     // the file (NULL if slot unused)
+	Count  pagesize; // bytes in each page of the file
+	int    codec;    // how pages are compressed on disk
+	Count  blksize;  // file system block size (unit of hole punching)
+	Wal    wal;      // log receiving page writes (NULL if none)
+	Fsm    fsm;      // map of free space in pages (NULL if none)
+	PageID npages;   // next PageID to be allocated by addPage()
+	char  *base;     // start of mapping (NULL if not mapped)
+	size_t len;      // bytes mapped
+} files[MAXFILES];
+
+// serialises addPage() on the same file from several threads
+static pthread_mutex_t growing = PTHREAD_MUTEX_INITIALIZER;
+
+// current size of a file in bytes
+static size_t fileSize(FILE *f)
 {
-	Page p = malloc(PAGESIZE);
-	assert(p != NULL);
-	p->free = 0;
+	struct stat st;
+	int ok = fstat(fileno(f), &st);
+	assert(ok == 0);
+	return st.st_size;
+}
+
+// file system's preferred block size for a file
+static Count blockSize(FILE *f)
+{
+	struct stat st;
+	int ok = fstat(fileno(f), &st);
+	assert(ok == 0);
+	return (st.st_blksize > 0) ? st.st_blksize : 4096;
+}
+
+static int findFile(FILE *f)
+{
+	for (int i = 0; i < MAXFILES; i++)
+		if (files[i].file == f) return i;
+	return -1;
+}
+
+// is p a page inside one of the mappings?
+static Bool inMap(Page p)
+{
+	char *c = (char *)p;
+	for (int i = 0; i < MAXFILES; i++) {
+		if (files[i].base == NULL) continue;
+		if (c >= files[i].base && c < files[i].base + files[i].len)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// slot directory entry; offsets/lengths fit in 16 bits
+typedef struct {
+	unsigned short off;  // offset of tuple within data[]
+	unsigned short len;  // length of tuple
+	Bits hash;           // hash of tuple
+} Slot;
+
+// slot directory entry in formats 1..7
+typedef struct {
+	unsigned short off;
+	unsigned short len;
+} OldSlot;
+
+#define PAGEHDR  (2*sizeof(Offset) + sizeof(Count))
+
+// address of slot i
+static Slot *slot(Page p, Count i)
+{
+	return (Slot *)p->data + i;
+}
+
+// register a file of pages, all of the given size and codec
+// must be done before any other page operations on the file
+void attachFile(FILE *f, Count pagesize, int codec)
+{
+	assert(pagesize >= MINPAGESIZE && pagesize <= MAXPAGESIZE);
+	int i = findFile(NULL);
+	assert(i >= 0);
+	files[i].file = f;
+	files[i].pagesize = pagesize;
+	files[i].codec = codec;
+	files[i].blksize = blockSize(f);
+	files[i].wal = NULL;
+	files[i].fsm = NULL;
+	// last page of a compressed file may be only partly written
+	files[i].npages = (fileSize(f) + pagesize-1) / pagesize;
+	files[i].base = NULL;
+	files[i].len = 0;
+}
+
+// finished with a file: write back and forget its pages
+// must be done before the file is closed
+void detachFile(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	bufDrop(f);
+	if (files[i].base != NULL)
+		munmap(files[i].base, files[i].len);
+	files[i].file = NULL;
+	files[i].base = NULL;
+}
+
+// size of pages in a file
+Count filePageSize(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	return files[i].pagesize;
+}
+
+// how pages of a file are compressed
+int fileCodec(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	return files[i].codec;
+}
+
+// block size of the file system holding a file
+Count fileBlockSize(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	return files[i].blksize;
+}
+
+// send page writes for a file to a log (NULL to stop doing so)
+void setFileWal(FILE *f, Wal w)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	files[i].wal = w;
+}
+
+// log receiving page writes for a file (NULL if none)
+Wal fileWal(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	return files[i].wal;
+}
+
+// keep a free-space map for a file (NULL to stop doing so)
+// the map is filled in from the file's pages, unless it already
+//   holds an entry for every page (e.g. one saved by fsmSave())
+void setFileFsm(FILE *f, Fsm m)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	files[i].fsm = m;
+	if (m == NULL || fsmNPages(m) == files[i].npages) return;
+	fsmTruncate(m, 0);
+	for (PageID pid = 0; pid < files[i].npages; pid++) {
+		Page p = getPage(f, pid);
+		fsmSet(m, pid, pageFreeSpace(p), p->ovflow);
+		releasePage(p);
+	}
+}
+
+// free-space map for a file (NULL if none)
+Fsm fileFsm(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	return files[i].fsm;
+}
+
+// note the state of page p (page pid of file i) in its map
+static void noteSpace(int i, PageID pid, Page p)
+{
+	if (files[i].fsm != NULL)
+		fsmSet(files[i].fsm, pid, pageFreeSpace(p), p->ovflow);
+}
+
+// use direct I/O (O_DIRECT) for a file, bypassing the kernel's
+//   page cache so that pages are only cached in our own pool
+// (a mapped file is unmapped, as the mapping uses the page cache)
+// returns 0 status if the file system supports it
+Status directFile(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	if (files[i].base != NULL) {
+		munmap(files[i].base, files[i].len);
+		files[i].base = NULL;
+	}
+	int fd = fileno(f);
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
+		return -1;
+	return OK;
+}
+
+// set up an empty page in a buffer
+static void initPage(Page p, Count pagesize)
+{
+	p->free = pagesize - PAGEHDR;
 	p->ovflow = NO_PAGE;
 	p->ntuples = 0;
-	Count hdr_size = 2*sizeof(Offset) + sizeof(Count);
-	int dataSize = PAGESIZE - hdr_size;
-	memset(p->data, 0, dataSize);
+	memset(p->data, 0, pagesize - PAGEHDR);
+}
+
+// number of pages in a file (including any not yet written)
+Count fileNPages(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	return files[i].npages;
+}
+
+// create a new initially empty page in memory
+Page newPage(Count pagesize)
+{
+	Page p = malloc(pagesize);
+	assert(p != NULL);
+	initPage(p, pagesize);
 	return p;
 }
 
 // append a new Page to a file; return its PageID
 PageID addPage(FILE *f)
 {
-	int ok = fseek(f, 0, SEEK_END);
-	assert(ok == 0);
-	int pos = ftell(f);
-	assert(pos >= 0);
-	PageID pid = pos/PAGESIZE;
-	Page p = newPage();
-	ok = putPage(f, pid, p);
-	assert(ok == 0);
+	int i = findFile(f);
+	assert(i >= 0 && files[i].base == NULL);
+	Count size = files[i].pagesize;
+	pthread_mutex_lock(&growing);
+	PageID pid = files[i].npages++;
+	pthread_mutex_unlock(&growing);
+	Page p = (Page)bufClaim(f, pid);
+	initPage(p, size);
+	noteSpace(i, pid, p);
+	bufRelease((char *)p, TRUE);
+	return pid;
+}
+
+// write a page from newPage() straight to the end of a file,
+//   bypassing the pool (and any log); the page is freed
+// used to build files sequentially (see bulk.c); return its PageID
+PageID appendPage(FILE *f, Page p)
+{
+	int i = findFile(f);
+	assert(i >= 0 && files[i].base == NULL && !bufOwns((char *)p));
+	pthread_mutex_lock(&growing);
+	PageID pid = files[i].npages++;
+	pthread_mutex_unlock(&growing);
+	noteSpace(i, pid, p);
+	bufWriteThrough(f, pid, (char *)p);
+	free(p);
 	return pid;
 }
 
-// fetch a Page from a file; allocate a memory buffer
+// throw away all pages of a file, leaving it empty
+void emptyFile(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0 && files[i].base == NULL);
+	bufDrop(f);
+	if (ftruncate(fileno(f), 0) != 0)
+		fatal("Can't truncate file");
+	files[i].npages = 0;
+	if (files[i].fsm != NULL) fsmTruncate(files[i].fsm, 0);
+}
+
+// give up pages npages onwards of a file (no longer used by anyone)
+// later addPage()s hand out their PageIDs again; the file itself
+//   is only cut back by trimFile(), as the pages may still be
+//   waiting in the pool or a log to be written
+void truncateFile(FILE *f, Count npages)
+{
+	int i = findFile(f);
+	assert(i >= 0 && files[i].base == NULL);
+	pthread_mutex_lock(&growing);
+	assert(npages <= files[i].npages);
+	files[i].npages = npages;
+	pthread_mutex_unlock(&growing);
+	if (files[i].fsm != NULL) fsmTruncate(files[i].fsm, npages);
+}
+
+// give the space of pages past the end of a file (see
+//   truncateFile()) back to the file system
+// must only be done when none of the file's pages are in use, and
+//   none are still to be written from a log
+void trimFile(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0 && files[i].base == NULL);
+	off_t end = (off_t)files[i].npages * files[i].pagesize;
+	if (fileSize(f) <= end) return;
+	bufForget(f, files[i].npages);
+	if (ftruncate(fileno(f), end) != 0)
+		fatal("Can't truncate file");
+}
+
+// fetch a Page from a file; pins a buffer in the pool
+// (or points into the mapping, for a mapped file)
 Page getPage(FILE *f, PageID pid)
 {
 	assert(pid >= 0);
-	Page p = malloc(PAGESIZE);
+	int i = findFile(f);
+	assert(i >= 0);
+	size_t size = files[i].pagesize;
+	if (files[i].base != NULL && (pid+1)*size <= files[i].len)
+		return (Page)(files[i].base + pid*size);
+	Page p = (Page)bufFetch(f, pid);
 	assert(p != NULL);
-	int ok = fseek(f, pid*PAGESIZE, SEEK_SET);
-	assert(ok == 0);
-	int n = fread(p, 1, PAGESIZE, f);
-	assert(n == PAGESIZE);
 	return p;
 }
 
-// write a Page to a file; release allocated buffer
+// write a Page to a file; release its buffer
+// p is either a buffer from getPage() or a page from newPage()
 Status putPage(FILE *f, PageID pid, Page p)
 {
 	assert(pid >= 0);
-	int ok = fseek(f, pid*PAGESIZE, SEEK_SET);
-	assert(ok == 0);
-	int n = fwrite(p, 1, PAGESIZE, f);
-	assert(n == PAGESIZE);
+	int i = findFile(f);
+	assert(i >= 0 && files[i].base == NULL);
+	noteSpace(i, pid, p);
+	if (bufOwns((char *)p)) {
+		bufRelease((char *)p, TRUE);
+		return 0;
+	}
+	char *buf = bufClaim(f, pid);
+	memcpy(buf, p, files[i].pagesize);
+	bufRelease(buf, TRUE);
 	free(p);
 	return 0;
 }
 
-// insert a tuple into a page
+// finished with a Page that was not modified
+void releasePage(Page p)
+{
+	if (bufOwns((char *)p))
+		bufRelease((char *)p, FALSE);
+	else if (!inMap(p))
+		free(p);
+}
+
+// map a read-only file into memory, for use by getPage()
+// returns 0 status if successful (an empty file is not mapped,
+//   nor is a compressed one)
+Status mapFile(FILE *f)
+{
+	int i = findFile(f);
+	assert(i >= 0);
+	if (files[i].codec != CODEC_NONE) return -1;
+	size_t len = files[i].npages * (size_t)files[i].pagesize;
+	if (len == 0) return -1;
+	char *base = mmap(NULL, len, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (base == MAP_FAILED) return -1;
+	files[i].base = base;
+	files[i].len = len;
+	return OK;
+}
+
+// tell the kernel how the pages of a mapped file will be used
+// how is either PAGE_RANDOM (bucket probes) or PAGE_SEQUENTIAL (scans)
+void adviseFile(FILE *f, int how)
+{
+	int i = findFile(f);
+	if (i < 0 || files[i].base == NULL) return;
+	int advice = (how == PAGE_SEQUENTIAL) ? MADV_SEQUENTIAL : MADV_RANDOM;
+	madvise(files[i].base, files[i].len, advice);
+}
+
+// insert a tuple, whose hash is h, into a page
 // returns 0 status if successful
 // returns -1 if not enough room
-Status addToPage(Page p, Tuple t)
+Status addToPage(Page p, Tuple t, Bits h)
 {
 	int n = tupLength(t);
-	char *c = p->data + p->free;
-	Count hdr_size = 2*sizeof(Offset) + sizeof(Count);
 	// doesn't fit ... return fail code
 	// assume caller will put it elsewhere
-	if (c+n > &p->data[PAGESIZE-hdr_size-2]) return -1;
-	strcpy(c, t);
-	p->free += n+1;
+	if (n+sizeof(Slot) > pageFreeSpace(p)) return -1;
+	p->free -= n;
+	memcpy(p->data + p->free, t, n);
+	Slot *sl = slot(p, p->ntuples);
+	sl->off = p->free;
+	sl->len = n;
+	sl->hash = h;
 	p->ntuples++;
 	return OK;
 }
 
+// bytes of free space in an empty page of the given size
+Count pageCapacity(Count pagesize)
+{
+	return pagesize - PAGEHDR;
+}
+
+// bytes of free space that a page needs to hold tuple t
+Count tupleSpace(Tuple t)
+{
+	return tupLength(t) + sizeof(Slot);
+}
+
+// return tuple i in page (a pointer into the page itself)
+Tuple pageTuple(Page p, Count i)
+{
+	assert(i < p->ntuples);
+	return p->data + slot(p,i)->off;
+}
+
+// return the hash of tuple i in page
+Bits pageHash(Page p, Count i)
+{
+	assert(i < p->ntuples);
+	return slot(p,i)->hash;
+}
+
+// convert a page of relation r from an older format to the current one
+// - formats 0,1 have other layouts (and are PAGESIZE bytes)
+// - formats before 5 hold tuples as text, which are encoded
+// - formats before 8 have no hashes in slots, so tuples are hashed
+// tuples for which there is no longer room move to spill pages
+// returns number of spill pages (in *spill, a malloc'd array)
+Count upgradePage(Page p, Count format, Reln r, Page **spill)
+{
+	Count n = p->ntuples, i;
+	Count pagesize = pageSize(r);
+	assert(format < 8);
+	char *old = malloc(pagesize);
+	Offset *off = malloc((n+1) * sizeof(Offset));
+	assert(old != NULL && off != NULL);
+	memcpy(old, p, pagesize);
+	char *data = ((Page)old)->data;
+	// find where each tuple starts
+	Offset o = 0;
+	for (i = 0; i < n; i++) {
+		if (format == 0) {
+			off[i] = o;
+			o += strlen(data + o) + 1;
+		}
+		else if (format == 1) {
+			OldSlot *sl = (OldSlot *)(old + pagesize) - (i+1);
+			off[i] = sl->off;
+		}
+		else
+			off[i] = ((OldSlot *)data + i)->off;
+	}
+	// rebuild page, keeping as many tuples as fit
+	initPage(p, pagesize);
+	memset(p->data, 0, pagesize - PAGEHDR);
+	Count nspill = 0;
+	*spill = NULL;
+	for (i = 0; i < n; i++) {
+		Tuple t = (format < 5) ? makeTuple(data + off[i]) : data + off[i];
+		assert(t != NULL);
+		Bits h = tupleHash(r, t);
+		if (addToPage(p, t, h) != OK &&
+		    (nspill == 0 || addToPage((*spill)[nspill-1], t, h) != OK)) {
+			*spill = realloc(*spill, (nspill+1) * sizeof(Page));
+			assert(*spill != NULL);
+			(*spill)[nspill++] = newPage(pagesize);
+			Status ok = addToPage((*spill)[nspill-1], t, h);
+			assert(ok == OK);
+		}
+		if (format < 5) free(t);
+	}
+	free(off);
+	free(old);
+	return nspill;
+}
+
 // extract page info
 char *pageData(Page p) { return p->data; }
 Count pageNTuples(Page p) { return p->ntuples; }
 Offset pageOvflow(Page p) { return p->ovflow; }
 void pageSetOvflow(Page p, PageID pid) { p->ovflow = pid; }
 Count pageFreeSpace(Page p) {
-	Count hdr_size = 2*sizeof(Offset) + sizeof(Count);
-	return (PAGESIZE-hdr_size-p->free);
+	return (p->free - p->ntuples*sizeof(Slot));
 }
-
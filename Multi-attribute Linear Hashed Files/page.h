@@ -8,14 +8,44 @@
 
 typedef struct PageRep *Page;
 
+// access patterns for adviseFile()
+#define PAGE_RANDOM     0
+#define PAGE_SEQUENTIAL 1
+
 #include "defs.h"
 #include "tuple.h"
+#include "bits.h"
+#include "wal.h"
+#include "fsm.h"
 
-Page newPage();
+void attachFile(FILE *, Count, int);
+void detachFile(FILE *);
+Count filePageSize(FILE *);
+int fileCodec(FILE *);
+Count fileBlockSize(FILE *);
+void setFileWal(FILE *, Wal);
+Wal fileWal(FILE *);
+void setFileFsm(FILE *, Fsm);
+Fsm fileFsm(FILE *);
+Count fileNPages(FILE *);
+Status directFile(FILE *);
+Page newPage(Count);
 PageID addPage(FILE *);
+PageID appendPage(FILE *, Page);
+void emptyFile(FILE *);
+void truncateFile(FILE *, Count);
+void trimFile(FILE *);
 Page getPage(FILE *, PageID);
 Status putPage(FILE *, PageID, Page);
-Status addToPage(Page, Tuple);
+void releasePage(Page);
+Status mapFile(FILE *);
+void adviseFile(FILE *, int);
+Status addToPage(Page, Tuple, Bits);
+Count tupleSpace(Tuple);
+Count pageCapacity(Count);
+Tuple pageTuple(Page, Count);
+Bits pageHash(Page, Count);
+Count upgradePage(Page, Count, Reln, Page **);
 char *pageData(Page);
 Count pageNTuples(Page);
 Offset pageOvflow(Page);
@@ -7,6 +7,7 @@ Command line args give file parameters:
 * n = number of attributes in tuples
 * d = file depth (# bits used in hash)
 * cv = choice vector (e.g. 1,2,1,2,3,...)
+* hash = hash function the file uses (optional; default jenkins)
 
 The main loop reads queries one per line from stdin.
 Each query is a list of space-separated items.
@@ -62,6 +63,7 @@ int    n;               // number of attributes;
 int    d;               // file depth (use d or d+1 hash bits)
 CVitem cv[MAX_CVLEN];   // array of choice vector items
 int    ncv;             // number of items in choice vector
+int    hashfn;          // hash function (see hash.h)
 Qitem  q[MAX_ATTRS+1];  // parsed version of query
 
 // Functions (forward referenced)
@@ -86,6 +88,9 @@ int main(int argc, char **argv)
 		usage("Invalid file depth");
 	if (!makeChoiceVector(argv[3]))
 		usage("Invalid choice vector");
+	hashfn = (argc > 4) ? hashId(argv[4]) : HASH_JENKINS;
+	if (hashfn < 0)
+		usage("Invalid hash function");
 
 	// read queries and display required pages
 
@@ -169,7 +174,7 @@ int parseQuery(char *in)
 		}
 		else {
 			q[attr].known = 1;
-			q[attr].hash = hash_any((unsigned char *)w, strlen(w));
+			q[attr].hash = hashBytes(hashfn, (unsigned char *)w, strlen(w));
 		}
 		attr++;
 		if (attr > n+1) // too many values
@@ -195,6 +200,6 @@ void usage(char *message)
 {
 	if (message[0] != '\0')
 		fprintf(stderr, "%s\n", message);
-	fprintf(stderr, "Usage: ./pages  n  d  cv\n");
+	fprintf(stderr, "Usage: ./pages  n  d  cv  [hash]\n");
 	exit(1);
 }
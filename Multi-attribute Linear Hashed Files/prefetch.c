@@ -0,0 +1,133 @@
+// prefetch.c ... asynchronous page prefetch
+// part of Multi-attribute Linear-hashed Files
+// Reads pages ahead of a scan, so that it rarely waits for I/O
+
+#include <pthread.h>
+#include "defs.h"
+#include "prefetch.h"
+#include "page.h"
+
+// Requests go in a FIFO queue, served by a pool of reader threads
+// - serving a request reads the page via getPage() and releases
+//   it, leaving it in the buffer pool (or, for a mapped file,
+//   faulted into memory) for when the scan arrives there
+// - a request may name a chain file; once the page arrives, its
+//   overflow page (in that file) is queued straight away, so a
+//   whole bucket is read ahead without waiting for the scan
+// - there is a reader for each bucket of lookahead (up to
+//   MAXPREFETCH), so that as many reads are in flight as buckets
+//   are asked for; they are started as requests need them
+// Many reads are outstanding at once, so a scan over many buckets
+//   is limited by bandwidth rather than by the latency of each read
+// (no io_uring here: a pool of blocking readers gives the same
+//   overlap on any kernel, at the cost of a thread per read)
+
+#define MAXREQS 1024
+
+typedef struct {
+	FILE  *file;   // file holding page
+	PageID pid;    // page to read
+	FILE  *chain;  // file holding page's overflow pages (or NULL)
+	Count  epoch;  // value of epoch when request was made
+} Request;
+
+static Request queue[MAXREQS];
+static Count head = 0, nqueued = 0;
+static Count nactive = 0;     // requests being served
+static Count epoch = 0;       // bumped by each prefetchCancel()
+static Count lookahead = PREFETCH_DEPTH;
+static Count nreaders = 0;    // reader threads started
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+
+static struct {
+	Count issued;   // requests queued
+	Count read;     // requests served
+	Count dropped;  // requests cancelled or refused (queue full)
+} stats;
+
+// add request to queue (called with lock held)
+
+static void enqueue(FILE *f, PageID pid, FILE *chain)
+{
+	if (nqueued == MAXREQS) { stats.dropped++; return; }
+	Request *rq = &queue[(head + nqueued) % MAXREQS];
+	rq->file = f; rq->pid = pid; rq->chain = chain; rq->epoch = epoch;
+	nqueued++;
+	stats.issued++;
+	pthread_cond_signal(&work);
+}
+
+static void *reader(void *arg)
+{
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (nqueued == 0)
+			pthread_cond_wait(&work, &lock);
+		Request rq = queue[head];
+		head = (head + 1) % MAXREQS;
+		nqueued--;
+		nactive++;
+		pthread_mutex_unlock(&lock);
+		Page p = getPage(rq.file, rq.pid);
+		PageID ovp = pageOvflow(p);
+		releasePage(p);
+		pthread_mutex_lock(&lock);
+		// (unless the scan has been cancelled meanwhile)
+		if (rq.chain != NULL && ovp != NO_PAGE && rq.epoch == epoch)
+			enqueue(rq.chain, ovp, rq.chain);
+		stats.read++;
+		nactive--;
+		if (nactive == 0)
+			pthread_cond_broadcast(&idle);
+	}
+	return NULL;
+}
+
+// ask for page pid of f to be read in the background
+// if chain is not NULL, the page's overflow chain (which lives
+//   in chain) is read as well
+
+void prefetchPage(FILE *f, PageID pid, FILE *chain)
+{
+	pthread_mutex_lock(&lock);
+	Count want = (lookahead < 1) ? 1
+	           : (lookahead > MAXPREFETCH) ? MAXPREFETCH : lookahead;
+	for (; nreaders < want; nreaders++) {
+		pthread_t t;
+		int ok = pthread_create(&t, NULL, reader, NULL);
+		assert(ok == 0);
+		pthread_detach(t);
+	}
+	enqueue(f, pid, chain);
+	pthread_mutex_unlock(&lock);
+}
+
+// forget queued requests, and wait for those being served
+// must be done before closing any file named in a request
+
+void prefetchCancel()
+{
+	pthread_mutex_lock(&lock);
+	epoch++;
+	stats.dropped += nqueued;
+	nqueued = 0;
+	while (nactive > 0)
+		pthread_cond_wait(&idle, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+// how many buckets ahead queries should read (0 = no prefetch)
+
+void setPrefetchDepth(Count n) { lookahead = n; }
+Count prefetchDepth() { return lookahead; }
+
+// display prefetch counters
+
+void prefetchStats()
+{
+	printf("Prefetch: %u readers, %u requests, %u pages read, %u dropped\n",
+	       nreaders, stats.issued, stats.read, stats.dropped);
+}
@@ -0,0 +1,24 @@
+// prefetch.h ... interface to asynchronous page prefetch
+// part of Multi-attribute Linear-hashed Files
+// See prefetch.c for details of prefetch engine and functions
+
+#ifndef PREFETCH_H
+#define PREFETCH_H 1
+
+#include "defs.h"
+
+// most reader threads, whatever the depth (override with -DMAXPREFETCH=n)
+#ifndef MAXPREFETCH
+#define MAXPREFETCH 64
+#endif
+
+// default number of buckets a query reads ahead
+#define PREFETCH_DEPTH 16
+
+void prefetchPage(FILE *, PageID, FILE *);
+void prefetchCancel(void);
+void setPrefetchDepth(Count);
+Count prefetchDepth(void);
+void prefetchStats(void);
+
+#endif
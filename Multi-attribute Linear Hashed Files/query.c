@@ -8,6 +8,8 @@
 #include "reln.h"
 #include "tuple.h"
 #include "hash.h"
+#include "prefetch.h"
+#include "dir.h"
 
 // A suggestion ... you can change however you like
 
@@ -16,18 +18,98 @@ struct QueryRep
 	Reln rel;       // need to remember Relation info
 	Bits known;     // the hash value from MAH
 	Bits unknown;   // the unknown bits from MAH
-	Bits stbucket;   // start bucket value
 	Tuple qstring;
-	int depth;
-	Count count;      //count how many unknown bits in the certain depth
+	Bool matchall;  // no known attributes: every tuple matches
+	PageID *buckets;  // all buckets which may hold matches, in order
+	Count nbuckets;   // number of buckets
+	Count cur;        // index in buckets[] of current bucket
+	Count ahead;      // buckets[] up to here have been prefetched
 
 	PageID page_id;   // current page in scan
+	Page page;        // current page (held until scan leaves it)
 	int be_ovfl; // are we in the overflow pages?
-	Offset pg_id;    // offset of current tuple within page
 	Count nb_tups;     // number of tuples scanned in page_id
-	Bits cmb_ukn;    // cur combination of unknown bits
 };
 
+static int cmpPageID(const void *a, const void *b)
+{
+	PageID x = *(PageID *)a, y = *(PageID *)b;
+	return (x > y) - (x < y);
+}
+
+// list the buckets that may hold tuples matching the query
+// Any hash value with the known bits of q->known can match
+// - bits above depth+1 don't affect which bucket a tuple is in
+// - for a hash h, the bucket is the lower depth bits of h, or
+//   the lower depth+1 bits if that bucket has already been split
+// so try every setting of the unknown bits among the lower
+//   depth+1 bits, and keep the distinct buckets they lead to
+
+static void findBuckets(Query q)
+{
+	Reln r = q->rel;
+	Count d = depth(r);
+	Bits lowd = (d == 0) ? 0 : (~0U >> (MAXBITS-d));
+	Bits low = (lowd << 1) | 1;  // lower depth+1 bits
+	Bits topbit = low & ~lowd;
+	Bits unknown = q->unknown & low;
+	Bits known = q->known & low & ~unknown;
+	q->buckets = malloc(npages(r) * sizeof(PageID));
+	assert(q->buckets != NULL);
+	q->nbuckets = 0;
+	// step through all subsets of the unknown bits
+	Bits sub = 0;
+	do {
+		Bits h = known | sub;
+		PageID id = h & lowd;
+		if (id < splitp(r))
+			id = h;
+		else if ((h & topbit) && (unknown & topbit))
+			id = NO_PAGE;  // same bucket as with top bit clear
+		if (id != NO_PAGE)
+			q->buckets[q->nbuckets++] = id;
+		sub = (sub - unknown) & unknown;
+	} while (sub != 0);
+	qsort(q->buckets, q->nbuckets, sizeof(PageID), cmpPageID);
+}
+
+// drop buckets which the relation's directory (if it has one)
+//   says are empty, so that their pages are never read
+
+static void skipEmptyBuckets(Query q)
+{
+	Dir d = bucketDir(q->rel);
+	if (d == NULL) return;
+	Count n = 0;
+	for (Count i = 0; i < q->nbuckets; i++) {
+		if (dirBucket(d, q->buckets[i])->ntuples > 0)
+			q->buckets[n++] = q->buckets[i];
+	}
+	q->nbuckets = n;
+}
+
+// does bucket b have overflow pages? (assume so if not known)
+
+static Bool hasOvflow(Query q, PageID b)
+{
+	Dir d = bucketDir(q->rel);
+	return d == NULL || dirBucket(d, b)->npages > 1;
+}
+
+// keep the next prefetchDepth() buckets being read in background
+
+static void readAhead(Query q)
+{
+	Count limit = q->cur + 1 + prefetchDepth();
+	if (limit > q->nbuckets) limit = q->nbuckets;
+	if (q->ahead < q->cur + 1) q->ahead = q->cur + 1;
+	for (; q->ahead < limit; q->ahead++) {
+		PageID b = q->buckets[q->ahead];
+		FILE *chain = hasOvflow(q, b) ? fovflow(q->rel) : NULL;
+		prefetchPage(fdata(q->rel), b, chain);
+	}
+}
+
 // take a query string (e.g. "1234,?,abc,?")
 // set up a QueryRep object for the scan
 
@@ -45,109 +127,57 @@ Query startQuery(Reln r, char *q)
 	assert(new != NULL);
 	new->rel = r;
 	new->be_ovfl = 0;
+	new->buckets = NULL;
 
 	Count nvals = nattrs(r);
-	//char *qu = strdup(q);
-	new->qstring = strdup(q);
-	//char *de = ",";
-	char *vals[nvals];
+	new->qstring = makeTuple(q);
+	if (new->qstring == NULL || tupleNAttrs(new->qstring) != nvals) {
+		free(new->qstring);
+		free(new);
+		return NULL;
+	}
 	Bits hash[nvals];
 	int i = 0;
 	int attrknow[nvals];
-	char buf[MAXBITS+1]; // for debug
 
-	tupleVals(q,vals);
-	new->pg_id = 0;
+	new->page = NULL;
 	new->nb_tups = 0;
-	new->cmb_ukn = 0x00000000;
+	attrHashes(r, new->qstring, hash);  // all values at once
 	while(i < nvals)
 	{
-		//vals[i] = strsep(&qu, de);
-		if (vals[i] == NULL)
-		{
-			exit(0);
-		}
-
-		attrknow[i] = strcmp(vals[i], "?");
+		attrknow[i] = tupleKnown(new->qstring, i);
 		if (!attrknow[i])
 		{
 			hash[i] = 0x00000000;
 		} 
-		else
-		{
-			hash[i] = hash_any((unsigned char *) vals[i], strlen(vals[i]));
-		}
-
-		bitsString(hash[i],buf);
-		i++;
-	}
-	//free(qu);
-
-	Bits qhash = 0xFFFFFFFF;
-	Bits nknow = 0x00000000;
-	ChVecItem *cv = chvec(r);
-	Byte bit;
-	Byte att;
-	Bits mask = 0x00000000;
-	//Not tested
-	i = 0;
-	while(i < MAXBITS)
-	{
-		mask = 0x00000000;
-		att = cv[i].att;
-		bit = cv[i].bit;
-		if (!attrknow[att])
-			nknow = setBit(nknow, i);
-		mask = setBit(mask, bit);
-		if ((hash[att] & mask) == 0)
-			qhash = unsetBit(qhash, i);
 		i++;
 	}
+	new->matchall = TRUE;
+	for (i = 0; i < nvals; i++)
+		if (attrknow[i]) new->matchall = FALSE;
+
+	// known bits: as in the tuple hash, with the unknown values' bits 0
+	// unknown bits: those taken from the unknown values
+	CvMap cv = chvecMap(r);
+	new->known = cvHash(cv, hash);
+	new->unknown = 0;
+	for (i = 0; i < nvals; i++)
+		if (!attrknow[i]) new->unknown |= cvAttrBits(cv, i);
+
+	findBuckets(new);
+
+	// a query which reads every bucket reads them in order;
+	// otherwise it probes a few scattered buckets
+	int how = (new->nbuckets == npages(r)) ? PAGE_SEQUENTIAL : PAGE_RANDOM;
+	adviseFile(fdata(r), how);
+	adviseFile(fovflow(r), how);
+
+	skipEmptyBuckets(new);
+	new->cur = 0;
+	new->ahead = 0;
+	new->page_id = (new->nbuckets > 0) ? new->buckets[0] : NO_PAGE;
+	readAhead(new);
 
-	new->known = qhash;
-	bitsString(qhash,buf);
-
-	new->unknown = nknow;
-	//showBits(nknow,buf);
-	//printf("nknow is %s\n",buf);
-
-	mask = 0x00000000;
-	int d = depth(r);
-	int j = 0;
-	while(j < d)
-	{
-		mask = setBit(mask, j);
-		j++;
-	}
-	//printf("%u\n",mask);
-	PageID id = qhash & mask;
-	new->depth = depth(r);
-	if (id < splitp(r))
-	{
-		mask = setBit(mask, d);
-		id = qhash & mask;
-		new->depth++;
-	}
-	new->stbucket = id;
-	new->page_id = id;
-
-	int count = 0;
-	int k = 0;
-	while(k < MAXBITS-1)
-	{
-		if (k >= new->depth)
-			break;
-		if (nknow & (0x00000001 << k))
-			count++;
-		k++;
-	}
-	
-	new->count = count;
-
-//debug
-//	showBits(id, buf);
-//	printf("ID        %s\n", buf);
-//	printf("start q OK\n");
 	return new;
 }
 
@@ -171,6 +201,7 @@ Tuple getNextTuple(Query q)
 	// endif
 
 	Reln r = q->rel;
+	if (q->cur >= q->nbuckets) return NULL;
 	while (1)
 	{
 		PageID pid = q->page_id;
@@ -185,92 +216,73 @@ Tuple getNextTuple(Query q)
 			file = fdata(r);
 		}
 
-		p = getPage(file, pid);
+		if (q->page == NULL)
+			q->page = getPage(file, pid);
+		p = q->page;
 		//scan the cur page until there is no left tuples
 		//return if find match
+		//(returned tuple points into the page, valid until next call)
 		while (q->nb_tups < pageNTuples(p))
 		{
-			Tuple tmp = nextTuple(file,q->page_id,q->pg_id);
-			q->nb_tups++;
-			q->pg_id = q->pg_id + strlen(tmp) + 1;
-			//printf("all tuples : %s   %d\n", tmp, strlen(tmp));	//debug
-			if (tupleMatch(r, q->qstring, tmp))
-				return tmp;
-			free(tmp);
+			Count i = q->nb_tups++;
+			if (queryMatch(q, pageTuple(p, i), pageHash(p, i)))
+				return pageTuple(p, i);
 		}
 
 		//switch to next page or overflow
 		Offset ovflw = pageOvflow(p);
-		if (ovflw != -1)
+		releasePage(p);
+		q->page = NULL;
+		if (ovflw != NO_PAGE)
 		{
 			q->page_id = ovflw;
 			q->nb_tups = 0;
-			q->pg_id = 0;
 			q->be_ovfl = 1;
 			continue;
 		} 
 		else
 		{
-			Bits uknow = q->unknown;
-			Bits op = q->cmb_ukn;
-			op++;
-			int i;
-			int count = q->count;
-
-			if (op >= (0x00000001 << count))
-			{
-				// including three cases:
-				// 1) op from 0x11111111 to 0x00000000, count == 8
-				// 2) op from 0x00000000 to 0x00000001, count == 0 (no unknown bits)
-				// 3) op from 0x0000000F to 0x00000010, count == 4 (normal case)
+			q->cur++;
+			if (q->cur >= q->nbuckets)
 				break;
-			}
-			q->cmb_ukn = op;
-
-			int offset = 0;
-			Bits mask = 0;
-			for (i = 0; i < count; ++i)
-			{
-				while (!(uknow & (setBit(0, offset))))
-					offset++;
-
-				if (op & setBit(0, i))
-					mask = setBit(mask, offset);
-
-				offset++;
-			}
-			PageID id = q->stbucket | mask;
-
-			if(id > npages(r)-1)
-				break;
-			//debug
-//			char buf[35];
-//			showBits(q->page_id, buf);
-//			printf("from page\n    %s\n", buf);
-//			showBits(id, buf);
-//			printf("     to\n    %s\n", buf);
-
-//
-//			showBits(q->stbucket, buf);
-//			printf("stbucket\n    %s\n ", buf);
-//			showBits(mask, buf);
-//			printf("mask\n    %s\n   op = %d    count = %d   depth = %d\n", buf,op,count,q->depth);
-
-			q->page_id = id;
+			readAhead(q);
+			q->page_id = q->buckets[q->cur];
 			q->nb_tups = 0;
-			q->pg_id = 0;
 			q->be_ovfl = 0;
-
 		}
 	}
 
 	return NULL;
 }
 
+// buckets which may hold tuples matching q (in order); sets *n
+//   to their number
+
+PageID *queryBuckets(Query q, Count *n)
+{
+	*n = q->nbuckets;
+	return q->buckets;
+}
+
+// does tuple t, whose hash is h, match q?
+// (a tuple whose hash disagrees with the query's known bits can't,
+//   so its values need not be compared)
+
+Bool queryMatch(Query q, Tuple t, Bits h)
+{
+	if (q->matchall) return TRUE;
+	if ((h & ~q->unknown) != q->known) return FALSE;
+	return tupleMatch(q->rel, q->qstring, t);
+}
+
 // clean up a QueryRep object and associated data
 
 void closeQuery(Query q)
 {
-	// TODO
+	if (q->page != NULL)
+		releasePage(q->page);
+	prefetchCancel();
+	free(q->buckets);
+	free(q->qstring);
 	free(q);
 }
@@ -13,6 +13,8 @@ typedef struct QueryRep *Query;
 
 Query startQuery(Reln, char *);
 Tuple getNextTuple(Query);
+PageID *queryBuckets(Query, Count *);
+Bool queryMatch(Query, Tuple, Bits);
 void closeQuery(Query);
 
 #endif
@@ -2,6 +2,9 @@
 // part of Multi-attribute Linear-hashed Files
 // Last modified by John Shepherd, July 2019
 
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "defs.h"
 #include "reln.h"
 #include "page.h"
@@ -9,8 +12,16 @@
 #include "chvec.h"
 #include "bits.h"
 #include "hash.h"
+#include "buf.h"
+#include "codec.h"
+#include "wal.h"
+#include "fsm.h"
+#include "dir.h"
+#include "split.h"
+#include "query.h"
 
 #define HEADERSIZE (3*sizeof(Count)+sizeof(Offset))
+#define NLATCHES 64
 
 struct RelnRep {
 	Count  nattrs; // number of attributes
@@ -19,31 +30,253 @@ struct RelnRep {
     Count  npages; // number of main data pages
     Count  ntups;  // total number of tuples
 	ChVec  cv;     // choice vector
+	Count  hashed; // attributes used by cv (see chvecAttrs())
+	CvMap  cvmap;  // cv, compiled (see compileChVec())
+	Count  format; // on-disk format version (see reln.h)
+	Count  pagesize; // bytes per page in data and ovflow files
+	PageID freeovf; // first page in list of free ovflow pages
+	Count  codec;  // how pages are compressed on disk (see codec.h)
+	SplitPolicy split; // when to split buckets (see split.h)
+	Count  hash;   // how attribute values are hashed (see hash.h)
+	Count  textints; // int values hashed in text form (pre-format 9)
+	unsigned long long nbytes; // page space used by tuples (if writable)
 	char   mode;   // open for read/write
+	Wal    wal;    // log of changes (NULL if read-only)
 	FILE  *info;   // handle on info file
 	FILE  *data;   // handle on data file
 	FILE  *ovflow; // handle on ovflow file
+	FILE  *fsmfile; // handle on free-space map file (NULL if none)
+	Dir    dir;    // directory of buckets (NULL if none)
+	FILE  *dirfile; // handle on directory file (NULL if none)
+	// for splitting in the background (see splitRelation())
+	pthread_mutex_t lock;   // protects depth, sp, npages, pending
+	pthread_mutex_t meta;   // protects freeovf and dir
+	pthread_mutex_t splitting; // held while a split is under way
+	pthread_mutex_t latch[NLATCHES]; // bucket b uses latch[b%NLATCHES]
+	pthread_rwlock_t inserts; // shared by inserts, exclusive for commits
+	pthread_cond_t  wake;   // splits are pending, or worker must stop
+	Bool   background; // splits done by worker thread
+	Bool   stopping;   // worker is to finish pending splits and exit
+	Count  pending;    // splits asked for but not yet started
+	pthread_t worker;
 };
 
+// Relations have side files, which hold what could be worked out
+//   from their pages, but only by reading them all
+// - R.fsm: a free-space map (see fsm.c) for each of the data and
+//   ovflow files (kept only while the relation is writable)
+// - R.dir: a directory of buckets (see dir.c)
+// Each holds #tuples and #pages, then the maps or the directory
+// They are saved at each checkpoint, so they match the files as
+//   they were then; they are thrown away when the files are
+//   changed without them (recovery, upgrade), and rebuilt from the
+//   pages if missing or they do not match the relation
+// (a read-only relation just does without a directory it can't use)
+
+static void dropSideFiles(char *name)
+{
+	char fname[MAXFILENAME];
+	sprintf(fname,"%s.fsm",name);
+	remove(fname);
+	sprintf(fname,"%s.dir",name);
+	remove(fname);
+}
+
+// open side file name.ext (creating it, if writable)
+// sets *valid if it was saved with r as it is now
+
+static FILE *openSideFile(Reln r, char *name, char *ext, Bool write,
+                          Bool *valid)
+{
+	char fname[MAXFILENAME];
+	sprintf(fname,"%s.%s",name,ext);
+	FILE *f = fopen(fname, write ? "r+" : "r");
+	if (f == NULL && write) f = fopen(fname,"w+");
+	*valid = FALSE;
+	if (f == NULL) return NULL;
+	Count stamp[2];
+	*valid = fread(stamp, sizeof(Count), 2, f) == 2
+	         && stamp[0] == r->ntups && stamp[1] == r->npages;
+	return f;
+}
+
+// fill in the directory from the pages of every bucket
+
+static void scanBuckets(Reln r)
+{
+	Count room = pageCapacity(r->pagesize);
+	dirTruncate(r->dir, 0);
+	for (PageID p = 0; p < r->npages; p++) {
+		Bucket *b = dirBucket(r->dir, p);
+		b->npages = 0;
+		FILE *f = r->data;
+		PageID pid = p;
+		while (pid != NO_PAGE) {
+			Page pg = getPage(f, pid);
+			b->ntuples += pageNTuples(pg);
+			b->nbytes += room - pageFreeSpace(pg);
+			b->npages++;
+			if (f == r->ovflow) b->tail = pid;
+			pid = pageOvflow(pg);
+			releasePage(pg);
+			f = r->ovflow;
+		}
+	}
+}
+
+static void openSideFiles(Reln r, char *name, Bool write)
+{
+	Bool valid;
+	if (write) {
+		r->fsmfile = openSideFile(r, name, "fsm", TRUE, &valid);
+		assert(r->fsmfile != NULL);
+		FILE *fs[2] = { r->data, r->ovflow };
+		for (int i = 0; i < 2; i++) {
+			Fsm m = newFsm(r->pagesize);
+			if (valid && fsmLoad(m, r->fsmfile) != OK) valid = FALSE;
+			setFileFsm(fs[i], m);
+		}
+	}
+	r->dirfile = openSideFile(r, name, "dir", write, &valid);
+	if (r->dirfile == NULL) return;
+	r->dir = newDir();
+	if (!valid || dirLoad(r->dir, r->dirfile) != OK
+	           || dirNBuckets(r->dir) != r->npages) {
+		if (write)
+			scanBuckets(r);
+		else {
+			freeDir(r->dir);
+			r->dir = NULL;
+		}
+	}
+	if (!write) {
+		fclose(r->dirfile);
+		r->dirfile = NULL;
+		return;
+	}
+	// total space used, for the split policy
+	for (PageID p = 0; p < r->npages; p++)
+		r->nbytes += dirBucket(r->dir, p)->nbytes;
+}
+
+// start saving side file f: stamp it with r as it is now
+
+static void stampSideFile(Reln r, FILE *f)
+{
+	Count stamp[2] = { r->ntups, r->npages };
+	rewind(f);
+	int ok = fwrite(stamp, sizeof(Count), 2, f);
+	assert(ok == 2);
+}
+
+// finish saving side file f (stamp and contents written so far)
+
+static void saveSideFile(FILE *f, Bool sync)
+{
+	fflush(f);
+	if (ftruncate(fileno(f), ftell(f)) != 0)
+		fatal("Can't write side file");
+	if (sync) fdatasync(fileno(f));
+}
+
+static void saveSideFiles(Reln r, Bool sync)
+{
+	if (r->fsmfile != NULL) {
+		stampSideFile(r, r->fsmfile);
+		fsmSave(fileFsm(r->data), r->fsmfile);
+		fsmSave(fileFsm(r->ovflow), r->fsmfile);
+		saveSideFile(r->fsmfile, sync);
+	}
+	if (r->dirfile != NULL) {
+		stampSideFile(r, r->dirfile);
+		dirSave(r->dir, r->dirfile);
+		saveSideFile(r->dirfile, sync);
+	}
+}
+
+static void closeSideFiles(Reln r)
+{
+	if (r->fsmfile != NULL) {
+		FILE *fs[2] = { r->data, r->ovflow };
+		for (int i = 0; i < 2; i++) {
+			freeFsm(fileFsm(fs[i]));
+			setFileFsm(fs[i], NULL);
+		}
+		fclose(r->fsmfile);
+	}
+	if (r->dirfile != NULL) fclose(r->dirfile);
+	if (r->dir != NULL) freeDir(r->dir);
+	r->fsmfile = r->dirfile = NULL;
+	r->dir = NULL;
+}
+
+static void initLatches(Reln r)
+{
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_mutex_init(&r->meta, NULL);
+	pthread_mutex_init(&r->splitting, NULL);
+	for (int i = 0; i < NLATCHES; i++)
+		pthread_mutex_init(&r->latch[i], NULL);
+	pthread_cond_init(&r->wake, NULL);
+	// (so that commits aren't put off forever by a stream of inserts)
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+	                              PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&r->inserts, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	r->background = r->stopping = FALSE;
+	r->pending = 0;
+}
+
+static void freeLatches(Reln r)
+{
+	pthread_mutex_destroy(&r->lock);
+	pthread_mutex_destroy(&r->meta);
+	pthread_mutex_destroy(&r->splitting);
+	for (int i = 0; i < NLATCHES; i++)
+		pthread_mutex_destroy(&r->latch[i]);
+	pthread_cond_destroy(&r->wake);
+	pthread_rwlock_destroy(&r->inserts);
+}
+
 // create a new relation (three files)
 
-Status newRelation(char *name, Count nattrs, Count npages, Count d, char *cv)
+Status newRelation(char *name, Count nattrs, Count npages, Count d, char *cv,
+                   Count pagesize, int codec, SplitPolicy *policy,
+                   int hash)
 {
     char fname[MAXFILENAME];
 	Reln r = malloc(sizeof(struct RelnRep));
 	r->nattrs = nattrs; r->depth = d; r->sp = 0;
 	r->npages = npages; r->ntups = 0; r->mode = 'w';
+	r->wal = NULL;
+	r->fsmfile = r->dirfile = NULL;
+	r->dir = NULL;
+	r->format = RELN_FORMAT;
+	r->pagesize = pagesize;
+	r->freeovf = NO_PAGE;
+	r->codec = codec;
+	r->split = *policy;
+	r->hash = hash;
+	r->textints = FALSE;
+	initLatches(r);
 	assert(r != NULL);
 	if (parseChVec(r, cv, r->cv) != OK) return ~OK;
+	r->hashed = chvecAttrs(r->cv);
+	r->cvmap = compileChVec(r->cv);
 	sprintf(fname,"%s.info",name);
 	r->info = fopen(fname,"w");
 	assert(r->info != NULL);
 	sprintf(fname,"%s.data",name);
-	r->data = fopen(fname,"w");
+	r->data = fopen(fname,"w+");
 	assert(r->data != NULL);
 	sprintf(fname,"%s.ovflow",name);
-	r->ovflow = fopen(fname,"w");
+	r->ovflow = fopen(fname,"w+");
 	assert(r->ovflow != NULL);
+	dropSideFiles(name);
+	attachFile(r->data, pagesize, codec);
+	attachFile(r->ovflow, pagesize, codec);
 	int i;
 	for (i = 0; i < npages; i++) addPage(r->data);
 	closeRelation(r);
@@ -65,10 +298,9 @@ Bool existsRelation(char *name)
 	}
 }
 
-// set up a relation descriptor from relation name
 // open files, reads information from rel.info
 
-Reln openRelation(char *name, char *mode)
+static Reln openFiles(char *name, char *mode)
 {
 	Reln r;
 	r = malloc(sizeof(struct RelnRep));
@@ -88,198 +320,666 @@ Reln openRelation(char *name, char *mode)
 	assert(n == 5);
 	n = fread(r->cv, sizeof(ChVecItem), MAXCHVEC, r->info);
 	assert(n == MAXCHVEC);
+	r->hashed = chvecAttrs(r->cv);
+	r->cvmap = compileChVec(r->cv);
+	// relations from before format numbers have nothing more
+	n = fread(&r->format, sizeof(Count), 1, r->info);
+	if (n != 1) r->format = 0;
+	// page size is recorded from format 2 onwards
+	if (r->format < 2)
+		r->pagesize = PAGESIZE;
+	else {
+		n = fread(&r->pagesize, sizeof(Count), 1, r->info);
+		assert(n == 1);
+	}
+	// free list of overflow pages is recorded from format 3 onwards
+	r->freeovf = NO_PAGE;
+	if (r->format >= 3) {
+		n = fread(&r->freeovf, sizeof(PageID), 1, r->info);
+		assert(n == 1);
+	}
+	// page compression is recorded from format 4 onwards
+	r->codec = CODEC_NONE;
+	if (r->format >= 4) {
+		n = fread(&r->codec, sizeof(Count), 1, r->info);
+		assert(n == 1 && r->codec < NCODECS);
+	}
+	// split policy is recorded from format 6 onwards
+	// (older relations keep the original one)
+	r->split.policy = SPLIT_COUNT;
+	r->split.fill = r->split.slack = r->split.maxchain = 0;
+	if (r->format >= 6) {
+		n = fread(&r->split, sizeof(Count), 4, r->info);
+		assert(n == 4 && r->split.policy < NSPLITPOLICIES);
+	}
+	// hash function is recorded from format 7 onwards
+	// (older relations keep the original one)
+	r->hash = HASH_JENKINS;
+	if (r->format >= 7) {
+		n = fread(&r->hash, sizeof(Count), 1, r->info);
+		assert(n == 1 && r->hash < NHASHES);
+	}
+	// how ints are hashed is recorded from format 9 onwards
+	// (older relations keep hashing their text, so that tuples
+	//   stay in the buckets they were put in)
+	r->textints = TRUE;
+	if (r->format >= 9) {
+		n = fread(&r->textints, sizeof(Count), 1, r->info);
+		assert(n == 1);
+	}
+	r->nbytes = 0;
+	attachFile(r->data, r->pagesize, r->codec);
+	attachFile(r->ovflow, r->pagesize, r->codec);
 	r->mode = (mode[0] == 'w' || mode[1] =='+') ? 'w' : 'r';
+	r->wal = NULL;
+	r->fsmfile = r->dirfile = NULL;
+	r->dir = NULL;
+	initLatches(r);
 	return r;
 }
 
+// contents of R.info for r, in buf; returns number of bytes
+// Naughty: assumes Count and Offset are the same size
+
+static Count packInfo(Reln r, char *buf)
+{
+	char *b = buf;
+	// core relation info (#attr,#pages,d,sp)
+	memcpy(b, r, 5*sizeof(Count)); b += 5*sizeof(Count);
+	// choice vector
+	memcpy(b, r->cv, MAXCHVEC*sizeof(ChVecItem)); b += MAXCHVEC*sizeof(ChVecItem);
+	memcpy(b, &r->format, sizeof(Count)); b += sizeof(Count);
+	memcpy(b, &r->pagesize, sizeof(Count)); b += sizeof(Count);
+	memcpy(b, &r->freeovf, sizeof(PageID)); b += sizeof(PageID);
+	memcpy(b, &r->codec, sizeof(Count)); b += sizeof(Count);
+	memcpy(b, &r->split, 4*sizeof(Count)); b += 4*sizeof(Count);
+	memcpy(b, &r->hash, sizeof(Count)); b += sizeof(Count);
+	memcpy(b, &r->textints, sizeof(Count)); b += sizeof(Count);
+	assert(b - buf <= WAL_MAXHDR);
+	return b - buf;
+}
+
+// replace contents of R.info by the n bytes in buf
+
+static void writeInfo(Reln r, char *buf, Count n, Bool sync)
+{
+	fseek(r->info, 0, SEEK_SET);
+	int ok = fwrite(buf, n, 1, r->info);
+	assert(ok == 1);
+	fflush(r->info);
+	if (sync) fdatasync(fileno(r->info));
+}
+
+// bring a relation up to date after a crash, from its log
+
+static void recoverRelation(char *name)
+{
+	Reln r = openFiles(name, "r+");
+	Wal w = openWal(name, WAL_SYNC_COMMIT);
+	walAttach(w, r->data);
+	walAttach(w, r->ovflow);
+	char info[WAL_MAXHDR];
+	Count n;
+	if (walRecover(w, info, &n) != OK)
+		fatal("Can't recover relation from its log");
+	if (n > 0) writeInfo(r, info, n, TRUE);
+	dropSideFiles(name);
+	walReset(w);
+	closeWal(w);
+	r->mode = 'r';  // descriptor is out of date; don't save it
+	closeRelation(r);
+}
+
+// set up a relation descriptor from relation name
+
+Reln openRelation(char *name, char *mode)
+{
+	if (walPending(name)) recoverRelation(name);
+	Reln r = openFiles(name, mode);
+	if (r->format != RELN_FORMAT) {
+		char err[MAXERRMSG+100];
+		sprintf(err, "Relation %s has format %d (expected %d); "
+		             "convert it with ./upgrade %s",
+		        name, r->format, RELN_FORMAT, name);
+		fatal(err);
+	}
+	// read-only relations access pages via mmap rather than the pool
+	if (r->mode == 'r') {
+		mapFile(r->data);
+		mapFile(r->ovflow);
+		openSideFiles(r, name, FALSE);
+	}
+	// changes to writable ones go via the log
+	else {
+		r->wal = openWal(name, WAL_SYNC_COMMIT);
+		walAttach(r->wal, r->data);
+		walAttach(r->wal, r->ovflow);
+		setFileWal(r->data, r->wal);
+		setFileWal(r->ovflow, r->wal);
+		openSideFiles(r, name, TRUE);
+	}
+	return r;
+}
+
+// choose when commits force the log to disk (see wal.h)
+
+void setSyncPolicy(Reln r, int policy)
+{
+	if (r->wal != NULL) walSetSync(r->wal, policy);
+}
+
+// copy committed pages from the log to the relation's own files,
+//   then empty the log
+
+static void checkpoint(Reln r)
+{
+	char info[WAL_MAXHDR];
+	Bool sync = walSync(r->wal) != WAL_SYNC_NONE;
+	walApply(r->wal);
+	writeInfo(r, info, packInfo(r, info), sync);
+	saveSideFiles(r, sync);
+	walReset(r->wal);
+	// pages given up by deletes can now go (see deleteFromRelation())
+	trimFile(r->data);
+	trimFile(r->ovflow);
+}
+
+// make all changes so far durable (as one atomic group)
+// waits for inserts under way (in other threads), and must not be
+//   called in the middle of an insert
+
+void commitRelation(Reln r)
+{
+	if (r->wal == NULL) return;
+	char info[WAL_MAXHDR];
+	// (not in the middle of a background split, either)
+	pthread_rwlock_wrlock(&r->inserts);
+	pthread_mutex_lock(&r->splitting);
+	bufFlush(r->data);
+	bufFlush(r->ovflow);
+	walCommit(r->wal, info, packInfo(r, info));
+	if (walSize(r->wal) > WAL_CHECKPOINT) checkpoint(r);
+	pthread_mutex_unlock(&r->splitting);
+	pthread_rwlock_unlock(&r->inserts);
+}
+
+// switch an open relation to direct I/O for its pages
+// returns 0 status if both files support it
+
+Status useDirectIO(Reln r)
+{
+	if (directFile(r->data) != OK) return ~OK;
+	if (directFile(r->ovflow) != OK) return ~OK;
+	return OK;
+}
+
+// record the shape of a relation whose pages were just built
+//   from scratch (see bulk.c): npages buckets holding ntups tuples
+//   (using nbytes of page space),
+//   with depth and split pointer as if it had grown by splitting,
+//   and no free overflow pages
+
+void setRelationSize(Reln r, Count npages, Count ntups,
+                     unsigned long long nbytes)
+{
+	assert(npages > 0);
+	Count d = 0;
+	while ((2u << d) <= npages) d++;
+	r->depth = d;
+	r->sp = npages - (1u << d);
+	r->npages = npages;
+	r->ntups = ntups;
+	r->nbytes = nbytes;
+	r->freeovf = NO_PAGE;
+	if (r->dir != NULL) dirTruncate(r->dir, 0);
+}
+
+// number of buckets r would have, if ntups tuples (using nbytes of
+//   page space) were inserted into it as it is now (see split.c)
+
+Count relationTarget(Reln r, Count ntups, unsigned long long nbytes)
+{
+	SplitInfo in = { ntups, nbytes, r->nattrs, r->npages,
+	                 pageCapacity(r->pagesize), r->pagesize, 0 };
+	return splitTarget(&r->split, &in);
+}
+
+// Overflow pages no longer used by any bucket are kept in a free
+//   list, linked through their ovflow fields, with the head of
+//   the list in R.info
+// Inserts take overflow pages from the list before growing the file
+
+// the page after free page pid in the free list
+// the free-space map holds the free list's links, so the page
+//   itself is only read if there's no map
+
+static PageID nextFree(Reln r, PageID pid)
+{
+	Fsm m = fileFsm(r->ovflow);
+	if (m != NULL) return fsmNext(m, pid);
+	Page pg = getPage(r->ovflow, pid);
+	PageID next = pageOvflow(pg);
+	releasePage(pg);
+	return next;
+}
+
+// take an overflow page, reusing a free one if possible, for the
+//   caller to overwrite; sets *reused if it came from the list
+
+static PageID claimOvflowPage(Reln r, Bool *reused)
+{
+	pthread_mutex_lock(&r->meta);
+	PageID pid = r->freeovf;
+	*reused = (pid != NO_PAGE);
+	if (pid == NO_PAGE)
+		pid = addPage(r->ovflow);
+	else
+		r->freeovf = nextFree(r, pid);
+	pthread_mutex_unlock(&r->meta);
+	return pid;
+}
+
+// get an empty overflow page, reusing a free one if possible
+
+static PageID newOvflowPage(Reln r)
+{
+	Bool reused;
+	PageID pid = claimOvflowPage(r, &reused);
+	if (reused) putPage(r->ovflow, pid, newPage(r->pagesize));
+	return pid;
+}
+
+// put an overflow page (no longer in any chain) on the free list
+
+static void freeOvflowPage(Reln r, PageID pid)
+{
+	Page pg = newPage(r->pagesize);
+	pthread_mutex_lock(&r->meta);
+	pageSetOvflow(pg, r->freeovf);
+	putPage(r->ovflow, pid, pg);
+	r->freeovf = pid;
+	pthread_mutex_unlock(&r->meta);
+}
+
+// take the free pages at the end of the overflow file (if every
+//   page from some point on is free) off the free list, and give
+//   them up (see truncateFile()); the rest of the list keeps its
+//   order, and only pages whose link changes are rewritten
+
+static void trimOvflowPages(Reln r)
+{
+	pthread_mutex_lock(&r->meta);
+	Count n = fileNPages(r->ovflow);
+	PageID *list = malloc((n+1) * sizeof(PageID));
+	Bool *isfree = calloc(n+1, sizeof(Bool));
+	assert(list != NULL && isfree != NULL);
+	Count nfree = 0;
+	for (PageID pid = r->freeovf; pid != NO_PAGE; pid = nextFree(r, pid)) {
+		assert(pid < n && nfree < n);
+		list[nfree++] = pid;
+		isfree[pid] = TRUE;
+	}
+	Count end = n;
+	while (end > 0 && isfree[end-1]) end--;
+	if (end < n) {
+		// relink what is left, from the back
+		PageID next = NO_PAGE;
+		for (Count i = nfree; i > 0; i--) {
+			PageID pid = list[i-1];
+			if (pid >= end) continue;
+			PageID old = (i < nfree) ? list[i] : NO_PAGE;
+			if (old != next) {
+				Page pg = newPage(r->pagesize);
+				pageSetOvflow(pg, next);
+				putPage(r->ovflow, pid, pg);
+			}
+			next = pid;
+		}
+		r->freeovf = next;
+		truncateFile(r->ovflow, end);
+	}
+	pthread_mutex_unlock(&r->meta);
+	free(isfree);
+	free(list);
+}
+
+// put all overflow pages not reachable from any bucket on the
+//   free list (relations before format 3 abandoned them on splits)
+
+static void reclaimOvflowPages(Reln r)
+{
+	Count n = fileNPages(r->ovflow);
+	Bool *used = calloc(n+1, sizeof(Bool));
+	assert(used != NULL);
+	for (PageID pid = 0; pid < r->npages; pid++) {
+		Page pg = getPage(r->data, pid);
+		PageID ovp = pageOvflow(pg);
+		releasePage(pg);
+		while (ovp != NO_PAGE) {
+			used[ovp] = TRUE;
+			pg = getPage(r->ovflow, ovp);
+			ovp = pageOvflow(pg);
+			releasePage(pg);
+		}
+	}
+	for (PageID ovp = n; ovp > 0; ovp--) {
+		if (!used[ovp-1]) freeOvflowPage(r, ovp-1);
+	}
+	free(used);
+}
+
+// rewrite every page in the current format (formats 0..7 -> 8)
+
+static void upgradePages(Reln r)
+{
+	for (PageID pid = 0; pid < r->npages; pid++) {
+		FILE *f = r->data;
+		PageID p = pid;
+		while (p != NO_PAGE) {
+			Page pg = getPage(f, p);
+			PageID next = pageOvflow(pg);
+			Page *spill;
+			Count nspill = upgradePage(pg, r->format, r, &spill);
+			// tuples that lost their room go in new overflow
+			// pages, spliced in after this one
+			PageID after = next;
+			for (Count i = nspill; i > 0; i--) {
+				PageID newp = newOvflowPage(r);
+				pageSetOvflow(spill[i-1], after);
+				putPage(r->ovflow, newp, spill[i-1]);
+				after = newp;
+			}
+			free(spill);
+			pageSetOvflow(pg, after);
+			putPage(f, p, pg);
+			f = r->ovflow;
+			p = next;
+		}
+	}
+}
+
+// convert a relation to the current on-disk format
+// format 0 -> 2: add slot directories to all pages
+// format 1 -> 2: move slot directories to the start of pages
+// format 2 -> 3: collect unused overflow pages in free list
+// format 3 -> 4: nothing to do (pages stay uncompressed)
+// format 4 -> 5: encode tuples in binary form
+// format 5 -> 6: nothing to do (keeps the original split policy)
+// format 6 -> 7: nothing to do (keeps the original hash function)
+// format 7 -> 8: store each tuple's hash in its slot
+// format 8 -> 9: nothing to do (keeps hashing ints as text, as
+//   hashing them in binary would move tuples to other buckets)
+// returns 0 status if successful
+
+Status upgradeRelation(char *name)
+{
+	Reln r = openFiles(name, "r+");
+	dropSideFiles(name);
+	if (r->format < 3)
+		reclaimOvflowPages(r);
+	if (r->format < 8)
+		upgradePages(r);
+	r->format = RELN_FORMAT;
+	closeRelation(r);
+	return OK;
+}
+
 // release files and descriptor for an open relation
 // copy latest information to .info file
 
 void closeRelation(Reln r)
 {
+	if (r->background) setBackgroundSplits(r, FALSE);
 	// make sure updated global data is put in info
-	// Naughty: assumes Count and Offset are the same size
-	if (r->mode == 'w') {
-		fseek(r->info, 0, SEEK_SET);
-		// write out core relation info (#attr,#pages,d,sp)
-		int n = fwrite(r, sizeof(Count), 5, r->info);
-		assert(n == 5);
-		// write out choice vector
-		n = fwrite(r->cv, sizeof(ChVecItem), MAXCHVEC, r->info);
-		assert(n == MAXCHVEC);
+	if (r->wal != NULL) {
+		commitRelation(r);
+		checkpoint(r);
+		setFileWal(r->data, NULL);
+		setFileWal(r->ovflow, NULL);
+		closeWal(r->wal);
 	}
+	else if (r->mode == 'w') {
+		char info[WAL_MAXHDR];
+		writeInfo(r, info, packInfo(r, info), FALSE);
+	}
+	closeSideFiles(r);
+	// write back any pages still held in the buffer pool
+	detachFile(r->data);
+	detachFile(r->ovflow);
 	fclose(r->info);
 	fclose(r->data);
 	fclose(r->ovflow);
+	freeLatches(r);
+	freeCvMap(r->cvmap);
 	free(r);
 }
 
-// insert a new tuple into a relation
-// returns index of bucket where inserted
-// - index always refers to a primary data page
-// - the actual insertion page may be either a data page or an overflow page
-// returns NO_PAGE if insert fails completely
-// TODO: include splitting and file expansion
+// directory entry for bucket p
+// (the directory may grow while a split is under way, so entries
+//   are copied in and out rather than used in place)
 
-Tuple nextTuple(FILE *in,PageID pid,Offset curtup)
+static Bucket getBucket(Reln r, PageID p)
 {
-	char line[MAXTUPLEN];
-	Offset base = PAGESIZE * pid + 2 * sizeof(Offset) + sizeof(Count);
-
-	fseek(in, base + curtup, SEEK_SET);
-	fgets(line, MAXTUPLEN - 1, in);
-	// count fields
-	// cheap'n'nasty parsing
-	char *c;
-	int nf = 1;
-	for (c = line; *c != '\0'; c++)
-		if (*c == ',')
-			nf++;
+	pthread_mutex_lock(&r->meta);
+	Bucket b = *dirBucket(r->dir, p);
+	pthread_mutex_unlock(&r->meta);
+	return b;
+}
 
-	return strdup(line); // needs to be free'd sometime
+static void setBucket(Reln r, PageID p, Bucket *b)
+{
+	pthread_mutex_lock(&r->meta);
+	*dirBucket(r->dir, p) = *b;
+	pthread_mutex_unlock(&r->meta);
 }
 
-Status insertintoPage(Reln r, Tuple t, PageID pid)
+static pthread_mutex_t *bucketLatch(Reln r, PageID p)
 {
-	//debug
-	//printf("Start Inserting [%s] to page %d", t, pid);
-	Page pg = getPage(r->data,pid);
+	return &r->latch[p % NLATCHES];
+}
 
-	if (addToPage(pg, t) == OK)
-	{
-		putPage(r->data, pid, pg);
-		return pid;
-	}
-	// primary data page full
-	if (pageOvflow(pg) == NO_PAGE)
-	{
-		// add first overflow page in chain
-		PageID newp = addPage(r->ovflow);
-		pageSetOvflow(pg, newp);
-		putPage(r->data, pid, pg);
-		Page newpg = getPage(r->ovflow, newp);
-		// can't add to a new page; we have a problem
-		if (addToPage(newpg, t) != OK)
-			return NO_PAGE;
-		putPage(r->ovflow, newp, newpg);
-		return pid;
-	} 
-	else
-	{
-		// scan overflow chain until we find space
-		// worst case: add new ovflow page at end of chain
-		Page ovpg, prevpg = NULL;
-		PageID ovp, prevp = NO_PAGE;
-		ovp = pageOvflow(pg);
-		while (ovp != NO_PAGE)
-		{
-			ovpg = getPage(r->ovflow, ovp);
-			if (addToPage(ovpg, t) != OK)
-			{
-				prevp = ovp;
-				prevpg = ovpg;
-				ovp = pageOvflow(ovpg);
-			} else
-			{
-				if (prevpg != NULL)
-					free(prevpg);
-				putPage(r->ovflow, ovp, ovpg);
-				return pid;
+// add tuple t, whose hash is h, to bucket p (whose latch the
+//   caller holds)
+// the directory gives the tail of the chain, which is the likeliest
+//   page to have room; if it hasn't, earlier pages are only tried
+//   if the bucket's other free space could hold t, and the
+//   free-space maps then show which page (if any) has room; so
+//   only one page of the chain is read
+// returns p, or NO_PAGE if t won't fit even in an empty page
+
+static PageID addToBucket(Reln r, PageID p, Tuple t, Bits h)
+{
+	Fsm dmap = fileFsm(r->data), omap = fileFsm(r->ovflow);
+	assert(dmap != NULL && omap != NULL && r->dir != NULL);
+	Bucket b = getBucket(r, p);
+	Count need = tupleSpace(t);
+	FILE *f = (b.tail == NO_PAGE) ? r->data : r->ovflow;
+	PageID pid = (b.tail == NO_PAGE) ? p : b.tail;
+	Count tailfree = fsmFree(fileFsm(f), pid);
+	Count bucketfree = b.npages * pageCapacity(r->pagesize) - b.nbytes;
+	if (tailfree < need && bucketfree >= tailfree + need) {
+		f = r->data;
+		pid = p;
+		PageID next = fsmNext(dmap, p);
+		Count skipped = 0;
+		if (fsmFree(dmap, p) < need) {
+			while (next != NO_PAGE) {
+				f = r->ovflow;
+				pid = next;
+				if (fsmFree(omap, pid) >= need) break;
+				next = fsmNext(omap, pid);
+				skipped++;
 			}
 		}
-		// all overflow pages are full; add another to chain
-		// at this point, there *must* be a prevpg
-		assert(prevpg != NULL);
-		// make new ovflow page
-		PageID newp = addPage(r->ovflow);
-		// insert tuple into new page
-		Page newpg = getPage(r->ovflow, newp);
-		if (addToPage(newpg, t) != OK)
-			return NO_PAGE;
-		putPage(r->ovflow, newp, newpg);
-		// link to existing overflow chain
-		pageSetOvflow(prevpg, newp);
-		putPage(r->ovflow, prevp, prevpg);
-		return pid;
-	}
-}
-
-void splitRelation(Reln r)
-{
-	addPage(r->data);
-	r->npages++;
-	//PageID addid = pid | setBit(0,r->depth);
+		fsmSkipped(skipped);
+	}
+	Page pg = getPage(f, pid);
+	if (addToPage(pg, t, h) == OK) {
+		putPage(f, pid, pg);
+		b.ntuples++;
+		b.nbytes += need;
+		setBucket(r, p, &b);
+		return p;
+	}
+	// every page in chain is full; add another at the end
+	assert(pageOvflow(pg) == NO_PAGE);
+	PageID newp = newOvflowPage(r);
+	Page newpg = getPage(r->ovflow, newp);
+	if (addToPage(newpg, t, h) != OK) {
+		releasePage(newpg);
+		releasePage(pg);
+		return NO_PAGE;
+	}
+	putPage(r->ovflow, newp, newpg);
+	pageSetOvflow(pg, newp);
+	putPage(f, pid, pg);
+	b.ntuples++;
+	b.nbytes += need;
+	b.npages++;
+	b.tail = newp;
+	setBucket(r, p, &b);
+	return p;
+}
 
-	//Dummy approach to store all the tups stay in original page
-	Tuple *tups_stay = malloc(1024 * sizeof(Tuple));
+// Splitting bucket sp reads its chain once, page by page, and
+//   sends each tuple to one of two builders: one refilling bucket
+//   sp, the other filling the new bucket
+// A builder holds the page it is filling in memory, and writes it
+//   only when it is full (or at the end), so every page of the two
+//   new chains is written exactly once
+// Overflow pages of the old chain are reused for the new chains
+//   once they have been read; if the new chains need more, they
+//   come from the free list, and any left over go back on it
+// A relation may hand its splits to a worker thread instead (see
+//   setBackgroundSplits()), so that no insert waits for a whole
+//   chain to be rewritten
+// - inserts ask for a split by counting it as pending, and go on
+//   addressing buckets by depth and sp as they are
+// - the worker splits bucket sp, then advances sp (and npages)
+//   under the relation's lock, so the new bucket becomes visible
+//   all at once
+// - each bucket has a latch (shared by every NLATCHES'th bucket),
+//   held by an insert while it changes the bucket, and by a split
+//   on both of its buckets throughout; an insert which had to wait
+//   checks that its tuple still belongs in the same bucket
+// - commits wait for any split under way to finish, so the log
+//   never holds half of a split
 
-	PageID pid = r->sp;
-	FILE * file = r->data;
-	int index = 0;
-	Offset curtup = 0;
-	Count nb_tups = 0;
+// a chain being built by a split
+typedef struct {
+	FILE  *f;     // file holding page being filled
+	PageID pid;   // where it goes in that file
+	Page   pg;    // the page being filled
+	Bucket info;  // shape of chain so far
+} Builder;
 
-	while (pid != NO_PAGE)
-	{
-		Page pg = getPage(file, pid);
-
-		if(pageNTuples(pg) == 0) break;
-
-		Tuple tmp = nextTuple(file, pid, curtup);
-		Bits hash, newid;
-
-		// newid is always a data page id
-		hash = tupleHash(r, tmp);
-		newid = getLower(hash, r->depth + 1);
-		//printf("tuple: [%s] ; newpid: [%d] ; pid: [%d]\n", tmp, newid, pid); //debug
-
-		//if tuple should stay in original page
-		if (newid == pid)
-		{
-			//printf("Put [%s] into tups_stay[%d]",tmp,index);  //debug
-			tups_stay[index++] = strdup(tmp);
-			//printf(" >>> finish\n"); //debug
-		} 
-		else
-		{
-			//insert tuple in new page
-			if (insertintoPage(r, tmp, newid) == NO_PAGE)
-				printf("Alarm!!!!!  Insert [%s] to NEW page %d go wrong\n", tmp,
-						newid);
-			//printf("  >>>  finish\n");//debug
-		}
-		curtup += strlen(tmp)+1;
-		nb_tups++;
+// old overflow pages which have been read, and so can be reused
+typedef struct {
+	PageID *pids;
+	Count   n;     // pages added
+	Count   used;  // pages taken again
+	Count   size;  // entries allocated
+} Spare;
 
-		// cur page has no more tuples
-		if (nb_tups >= pageNTuples(pg))
-		{
+static void addSpare(Spare *s, PageID pid)
+{
+	if (s->n == s->size) {
+		s->size = (s->size == 0) ? 16 : 2*s->size;
+		s->pids = realloc(s->pids, s->size * sizeof(PageID));
+		assert(s->pids != NULL);
+	}
+	s->pids[s->n++] = pid;
+}
 
-			//use a new empty page to cover the old one
-			Page cover = newPage();
-			putPage(file, pid, cover);
+static void startChain(Reln r, Builder *b, PageID bucket)
+{
+	b->f = r->data;
+	b->pid = bucket;
+	b->pg = newPage(r->pagesize);
+	b->info = (Bucket){ 0, 0, 1, NO_PAGE };
+}
 
-			pid = pageOvflow(pg);
-			nb_tups = 0;
-			curtup = 0;
-			file = r->ovflow;
-		}
-		free(tmp);
+// add tuple t, whose hash is h, to the chain in b, starting a new
+//   overflow page (a spare one if possible) when the current one
+//   is full
 
+static void buildChain(Reln r, Builder *b, Spare *s, Tuple t, Bits h)
+{
+	if (addToPage(b->pg, t, h) != OK) {
+		Bool reused;
+		PageID next = (s->used < s->n) ? s->pids[s->used++]
+		                               : claimOvflowPage(r, &reused);
+		pageSetOvflow(b->pg, next);
+		putPage(b->f, b->pid, b->pg);
+		b->f = r->ovflow;
+		b->pid = next;
+		b->pg = newPage(r->pagesize);
+		b->info.npages++;
+		b->info.tail = next;
+		int ok = addToPage(b->pg, t, h);
+		assert(ok == OK);  // it fitted in the old chain
 	}
+	b->info.ntuples++;
+	b->info.nbytes += tupleSpace(t);
+}
 
-	int i;
-	for (i = 0; i < index; ++i)
-	{
-		//printf("insert tups_stays[%d]\n",index);//debug
-		Tuple tmp = tups_stay[i];
-		if (insertintoPage(r, tmp, r->sp) == NO_PAGE)
-			printf("Alarm!!!!!  Inserting [%s] to page %d go wrong\n", tmp, r->sp);
-		//printf("  >>>  finish\n");//debug
-		free(tmp);
+// write the last page of the chain in b, and note its shape
+
+static void finishChain(Reln r, Builder *b, PageID bucket)
+{
+	putPage(b->f, b->pid, b->pg);
+	setBucket(r, bucket, &b->info);
+}
+
+// split bucket sp (only one split is ever under way)
+
+static void splitRelation(Reln r)
+{
+	pthread_mutex_lock(&r->splitting);
+	pthread_mutex_lock(&r->lock);
+	PageID oldb = r->sp;
+	Count d = r->depth;
+	PageID newb = r->npages;
+	pthread_mutex_unlock(&r->lock);
+	pthread_mutex_t *l1 = bucketLatch(r, oldb), *l2 = bucketLatch(r, newb);
+	if (l1 > l2) { pthread_mutex_t *l = l1; l1 = l2; l2 = l; }
+	pthread_mutex_lock(l1);
+	if (l2 != l1) pthread_mutex_lock(l2);
+	// (the data page may be left over from a merge)
+	PageID pid = (newb < fileNPages(r->data)) ? newb : addPage(r->data);
+	assert(pid == newb);
+	Builder stay, move;
+	startChain(r, &stay, oldb);
+	startChain(r, &move, newb);
+	Spare spare = { NULL, 0, 0, 0 };
+
+	// (each tuple's hash is in its slot, so it is not hashed again;
+	//   bit d of it says which bucket it goes to)
+	FILE *f = r->data;
+	pid = oldb;
+	while (pid != NO_PAGE) {
+		Page pg = getPage(f, pid);
+		for (Count i = 0; i < pageNTuples(pg); i++) {
+			Bits h = pageHash(pg, i);
+			Builder *b = bitIsSet(h, d) ? &move : &stay;
+			buildChain(r, b, &spare, pageTuple(pg, i), h);
+		}
+		PageID next = pageOvflow(pg);
+		releasePage(pg);
+		if (f == r->ovflow) addSpare(&spare, pid);
+		f = r->ovflow;
+		pid = next;
 	}
+	finishChain(r, &stay, oldb);
+	finishChain(r, &move, newb);
+	while (spare.used < spare.n)
+		freeOvflowPage(r, spare.pids[spare.used++]);
+	free(spare.pids);
 
-	free(tups_stay);
+	pthread_mutex_lock(&r->lock);
+	r->npages++;
+	assert(r->pending > 0);
+	r->pending--;
 	if (getLower(r->sp + 1, r->depth) != 0)
 	{
 		r->sp++;
@@ -289,89 +989,501 @@ void splitRelation(Reln r)
 		r->depth++;
 		r->sp = 0;
 	}
-	//printf("Split OK/n");   //debug
+	pthread_mutex_unlock(&r->lock);
+	if (l2 != l1) pthread_mutex_unlock(l2);
+	pthread_mutex_unlock(l1);
+	pthread_mutex_unlock(&r->splitting);
+}
 
+static void *splitter(void *arg)
+{
+	Reln r = arg;
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (r->pending == 0 && !r->stopping)
+			pthread_cond_wait(&r->wake, &r->lock);
+		if (r->pending == 0) break;
+		pthread_mutex_unlock(&r->lock);
+		splitRelation(r);
+		pthread_mutex_lock(&r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
 }
 
-PageID addToRelation(Reln r, Tuple t)
+// do splits in a worker thread (if on), or in addToRelation()
+// (pending splits are finished before the worker stops)
+
+void setBackgroundSplits(Reln r, Bool on)
 {
-	int nt = r->ntups + 1;
-	int na = r->nattrs;
-	if (nt % (1024 / (10 * na)) == 0) splitRelation(r);
+	assert(r->mode == 'w');
+	if (on == r->background) return;
+	if (on) {
+		r->stopping = FALSE;
+		r->background = TRUE;
+		int ok = pthread_create(&r->worker, NULL, splitter, r);
+		assert(ok == 0);
+	}
+	else {
+		pthread_mutex_lock(&r->lock);
+		r->stopping = TRUE;
+		pthread_cond_signal(&r->wake);
+		pthread_mutex_unlock(&r->lock);
+		pthread_join(r->worker, NULL);
+		r->background = FALSE;
+	}
+}
+
+// bucket which holds tuples with hash h
 
-	Bits h, p;
-	// char buf[MAXBITS+1];
-	h = tupleHash(r,t);
+static PageID bucketOf(Reln r, Bits h)
+{
+	PageID p;
 	if (r->depth == 0)
 		p = 1;
 	else {
 		p = getLower(h, r->depth);
 		if (p < r->sp) p = getLower(h, r->depth+1);
 	}
-	// bitsString(h,buf); printf("hash = %s\n",buf);
-	// bitsString(p,buf); printf("page = %s\n",buf);
-	Page pg = getPage(r->data,p);
-	if (addToPage(pg,t) == OK) 
-	{
-		putPage(r->data,p,pg);
-		r->ntups++;
-		return p;
+	return p;
+}
+
+// latch the bucket holding tuples with hash h (which a split may
+//   move them out of meanwhile); sets *p to the bucket
+
+static pthread_mutex_t *latchBucket(Reln r, Bits h, PageID *p)
+{
+	for (;;) {
+		pthread_mutex_lock(&r->lock);
+		*p = bucketOf(r, h);
+		pthread_mutex_unlock(&r->lock);
+		pthread_mutex_t *latch = bucketLatch(r, *p);
+		pthread_mutex_lock(latch);
+		pthread_mutex_lock(&r->lock);
+		PageID q = bucketOf(r, h);
+		pthread_mutex_unlock(&r->lock);
+		if (q == *p) return latch;
+		pthread_mutex_unlock(latch);
 	}
-	// primary data page full
-	if (pageOvflow(pg) == NO_PAGE) 
-	{
-		// add first overflow page in chain
-		PageID newp = addPage(r->ovflow);
-		pageSetOvflow(pg,newp);
-		putPage(r->data,p,pg);
-		Page newpg = getPage(r->ovflow,newp);
-		// can't add to a new page; we have a problem
-		if (addToPage(newpg,t) != OK) 
-			return NO_PAGE;
-		putPage(r->ovflow,newp,newpg);
+}
+
+// insert a new tuple into a relation, first splitting a bucket
+//   if the relation's split policy asks for it
+// returns index of bucket where inserted, or NO_PAGE if the
+//   insert fails completely
+
+PageID addToRelation(Reln r, Tuple t)
+{
+	return addHashedToRelation(r, t, tupleHash(r,t));
+}
+
+// as addToRelation(), for tuple t whose hash h is already known
+// may be called by several threads at once
+
+PageID addHashedToRelation(Reln r, Tuple t, Bits h)
+{
+	Count need = tupleSpace(t);
+	pthread_rwlock_rdlock(&r->inserts);
+	// count t in, and see whether that calls for a split
+	pthread_mutex_lock(&r->lock);
+	PageID p = bucketOf(r, h);
+	r->ntups++;
+	r->nbytes += need;
+	SplitInfo in = { r->ntups, r->nbytes, r->nattrs,
+	                 r->npages + r->pending,
+	                 pageCapacity(r->pagesize), r->pagesize,
+	                 getBucket(r, p).npages };
+	Bool split = splitWanted(&r->split, &in);
+	if (split) {
+		r->pending++;
+		if (r->background) pthread_cond_signal(&r->wake);
+	}
+	pthread_mutex_unlock(&r->lock);
+	if (split && !r->background) splitRelation(r);
+	pthread_mutex_t *latch = latchBucket(r, h, &p);
+	p = addToBucket(r, p, t, h);
+	pthread_mutex_unlock(latch);
+	if (p == NO_PAGE) {
+		pthread_mutex_lock(&r->lock);
+		r->ntups--;
+		r->nbytes -= need;
+		pthread_mutex_unlock(&r->lock);
+	}
+	pthread_rwlock_unlock(&r->inserts);
+	return p;
+}
+
+// add to page pg those of the n tuples in ts (with hashes hs) which
+//   fit, noting them in b; the rest are moved to the front of ts
+//   (and their hashes to the front of hs)
+// returns the number of tuples left
+
+static Count fillPage(Page pg, Tuple *ts, Bits *hs, Count n, Bucket *b)
+{
+	Count left = 0;
+	for (Count i = 0; i < n; i++) {
+		if (addToPage(pg, ts[i], hs[i]) == OK) {
+			b->ntuples++;
+			b->nbytes += tupleSpace(ts[i]);
+		}
+		else {
+			ts[left] = ts[i];
+			hs[left++] = hs[i];
+		}
+	}
+	return left;
+}
+
+// add the n tuples in ts, with hashes hs, to bucket p (whose latch
+//   the caller holds),
+//   reading and writing each page that gets any of them only once
+// as in addToBucket(), pages before the tail are only looked at if
+//   the bucket has room outside the tail, and the free-space maps
+//   show which might take a tuple; the tail is done last, as it
+//   may need a new successor, and pages added after it are built
+//   in memory and written when full
+
+static void addGroupToBucket(Reln r, PageID p, Tuple *ts, Bits *hs,
+                             Count n)
+{
+	Bucket b = getBucket(r, p);
+	Count least = MAXPAGESIZE;
+	for (Count i = 0; i < n; i++)
+		if (tupleSpace(ts[i]) < least) least = tupleSpace(ts[i]);
+	FILE *tf = (b.tail == NO_PAGE) ? r->data : r->ovflow;
+	PageID tail = (b.tail == NO_PAGE) ? p : b.tail;
+	Count room = b.npages * pageCapacity(r->pagesize) - b.nbytes;
+	if (room >= fsmFree(fileFsm(tf), tail) + least) {
+		FILE *f = r->data;
+		PageID pid = p;
+		Count skipped = 0;
+		while (n > 0 && !(f == tf && pid == tail)) {
+			Fsm m = fileFsm(f);
+			PageID next = fsmNext(m, pid);
+			if (fsmFree(m, pid) >= least) {
+				Page pg = getPage(f, pid);
+				Count left = fillPage(pg, ts, hs, n, &b);
+				if (left < n)
+					putPage(f, pid, pg);
+				else
+					releasePage(pg);
+				n = left;
+			}
+			else
+				skipped++;
+			f = r->ovflow;
+			pid = next;
+		}
+		fsmSkipped(skipped);
+	}
+	if (n > 0) {
+		Page pg = getPage(tf, tail);
+		n = fillPage(pg, ts, hs, n, &b);
+		while (n > 0) {
+			Bool reused;
+			PageID newp = claimOvflowPage(r, &reused);
+			pageSetOvflow(pg, newp);
+			putPage(tf, tail, pg);
+			tf = r->ovflow;
+			tail = newp;
+			pg = newPage(r->pagesize);
+			b.npages++;
+			b.tail = newp;
+			Count left = fillPage(pg, ts, hs, n, &b);
+			if (left == n) fatal("Tuple too big for page");
+			n = left;
+		}
+		putPage(tf, tail, pg);
+	}
+	setBucket(r, p, &b);
+}
+
+// a tuple of a batch, and where it goes
+typedef struct {
+	PageID bucket;
+	Bits   hash;
+	Tuple  tuple;
+} Placing;
+
+static int byBucket(const void *a, const void *b)
+{
+	PageID pa = ((Placing *)a)->bucket, pb = ((Placing *)b)->bucket;
+	return (pa > pb) - (pa < pb);
+}
+
+// insert the n tuples in ts into a relation
+// all the splits the batch calls for are done first (so none of
+//   its tuples is moved by them), then the tuples are sorted by
+//   bucket, and each bucket's are added together, with one read
+//   and one write of each page they go in
+// (for the chain-length limit of a split policy, a bucket's chain
+//   is taken to be as long as it was before the batch)
+// may be called by several threads at once
+
+void addTuplesToRelation(Reln r, Tuple *ts, Count n)
+{
+	if (n == 0) return;
+	Placing *pl = malloc(n * sizeof(Placing));
+	Tuple *group = malloc(n * sizeof(Tuple));
+	Bits *ghash = malloc(n * sizeof(Bits));
+	assert(pl != NULL && group != NULL && ghash != NULL);
+	for (Count i = 0; i < n; i += HASHBATCH) {
+		Bits hs[HASHBATCH];
+		Count m = (n - i < HASHBATCH) ? n - i : HASHBATCH;
+		tupleHashes(r, ts+i, m, hs);
+		for (Count k = 0; k < m; k++) {
+			pl[i+k].hash = hs[k];
+			pl[i+k].tuple = ts[i+k];
+		}
+	}
+	pthread_rwlock_rdlock(&r->inserts);
+
+	// count the tuples in, and see how many splits that calls for
+
+	pthread_mutex_lock(&r->lock);
+	Count nsplits = 0;
+	for (Count i = 0; i < n; i++) {
 		r->ntups++;
-		return p;
+		r->nbytes += tupleSpace(ts[i]);
+		SplitInfo in = { r->ntups, r->nbytes, r->nattrs,
+		                 r->npages + r->pending,
+		                 pageCapacity(r->pagesize), r->pagesize,
+		                 getBucket(r, bucketOf(r, pl[i].hash)).npages };
+		if (splitWanted(&r->split, &in)) {
+			r->pending++;
+			nsplits++;
+		}
 	}
-	else 
-	{
-		// scan overflow chain until we find space
-		// worst case: add new ovflow page at end of chain
-		Page ovpg, prevpg = NULL;
-		PageID ovp, prevp = NO_PAGE;
-		ovp = pageOvflow(pg);
-		while (ovp != NO_PAGE) 
-		{
-			ovpg = getPage(r->ovflow, ovp);
-			if (addToPage(ovpg,t) != OK) 
-			{
-				prevp = ovp; 
-				prevpg = ovpg;
-				ovp = pageOvflow(ovpg);
+	if (nsplits > 0 && r->background) pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+	if (!r->background)
+		for (Count i = 0; i < nsplits; i++) splitRelation(r);
+
+	// add tuples bucket by bucket
+	// (a split in another thread may move some of them on meanwhile;
+	//   they are kept, and sorted again for another round)
+
+	Count todo = n;
+	while (todo > 0) {
+		pthread_mutex_lock(&r->lock);
+		for (Count i = 0; i < todo; i++)
+			pl[i].bucket = bucketOf(r, pl[i].hash);
+		pthread_mutex_unlock(&r->lock);
+		qsort(pl, todo, sizeof(Placing), byBucket);
+		Count i = 0, nmoved = 0;
+		while (i < todo) {
+			PageID p;
+			pthread_mutex_t *latch = latchBucket(r, pl[i].hash, &p);
+			Count j, k = 0;
+			pthread_mutex_lock(&r->lock);
+			for (j = i; j < todo && pl[j].bucket == pl[i].bucket; j++) {
+				if (bucketOf(r, pl[j].hash) == p) {
+					group[k] = pl[j].tuple;
+					ghash[k++] = pl[j].hash;
+				}
+				else
+					pl[nmoved++] = pl[j];
 			}
-			else 
-			{
-				if (prevpg != NULL) free(prevpg);
-				putPage(r->ovflow,ovp,ovpg);
-				r->ntups++;
-				return p;
+			pthread_mutex_unlock(&r->lock);
+			addGroupToBucket(r, p, group, ghash, k);
+			pthread_mutex_unlock(latch);
+			i = j;
+		}
+		todo = nmoved;
+	}
+	pthread_rwlock_unlock(&r->inserts);
+	free(ghash);
+	free(group);
+	free(pl);
+}
+
+// Deleting tuples rewrites each bucket which had any of them in
+//   place, as a split does: its chain is read once and the
+//   tuples kept are packed into its pages from the start, so
+//   overflow pages it no longer needs go back on the free list
+// If that leaves the relation emptier than its split policy wants
+//   (see mergeWanted()), it contracts in the reverse of the order
+//   it grew: sp moves back, and the last bucket (the one made by
+//   the latest split) is merged into its buddy, bucket sp
+// Then the space no longer needed is given up: data pages past the
+//   last bucket, and free overflow pages at the end of that file
+//   (which come off the free list); the files themselves are cut
+//   back at the next checkpoint, once no page past their new ends
+//   is waiting in the log to be written (after a crash before
+//   then, the data file may keep pages past the last bucket, which
+//   splits reuse, and the overflow file may keep some pages which
+//   are in no bucket and not on the free list)
+// Both hold the relation's splitting lock throughout, so depth and
+//   sp don't change under them, and commits never see half of one;
+//   merges wait until any pending splits are done
+
+// rewrite bucket p (whose latch the caller holds) without the
+//   tuples which match q; adds the space they used to *nbytes
+// returns the number of tuples deleted
+
+static Count compactBucket(Reln r, PageID p, Query q,
+                           unsigned long long *nbytes)
+{
+	// look for matches first, so buckets without any aren't written
+	Count ndel = 0;
+	FILE *f = r->data;
+	PageID pid = p;
+	while (pid != NO_PAGE && ndel == 0) {
+		Page pg = getPage(f, pid);
+		for (Count i = 0; i < pageNTuples(pg); i++)
+			if (queryMatch(q, pageTuple(pg, i), pageHash(pg, i))) ndel++;
+		pid = pageOvflow(pg);
+		releasePage(pg);
+		f = r->ovflow;
+	}
+	if (ndel == 0) return 0;
+
+	ndel = 0;
+	Builder keep;
+	startChain(r, &keep, p);
+	Spare spare = { NULL, 0, 0, 0 };
+	f = r->data;
+	pid = p;
+	while (pid != NO_PAGE) {
+		Page pg = getPage(f, pid);
+		for (Count i = 0; i < pageNTuples(pg); i++) {
+			Tuple t = pageTuple(pg, i);
+			Bits h = pageHash(pg, i);
+			if (queryMatch(q, t, h)) {
+				*nbytes += tupleSpace(t);
+				ndel++;
 			}
+			else
+				buildChain(r, &keep, &spare, t, h);
 		}
-		// all overflow pages are full; add another to chain
-		// at this point, there *must* be a prevpg
-		assert(prevpg != NULL);
-		// make new ovflow page
-		PageID newp = addPage(r->ovflow);
-		// insert tuple into new page
-		Page newpg = getPage(r->ovflow,newp);
-        if (addToPage(newpg,t) != OK) return NO_PAGE;
-        putPage(r->ovflow,newp,newpg);
-		// link to existing overflow chain
-		pageSetOvflow(prevpg,newp);
-		putPage(r->ovflow,prevp,prevpg);
-        r->ntups++;
-		return p;
+		PageID next = pageOvflow(pg);
+		releasePage(pg);
+		if (f == r->ovflow) addSpare(&spare, pid);
+		f = r->ovflow;
+		pid = next;
 	}
-	return NO_PAGE;
+	finishChain(r, &keep, p);
+	while (spare.used < spare.n)
+		freeOvflowPage(r, spare.pids[spare.used++]);
+	free(spare.pids);
+	return ndel;
+}
+
+// undo the last split, by merging the last bucket into its buddy
+// (the caller holds the splitting lock)
+
+static void mergeBuckets(Reln r)
+{
+	pthread_mutex_lock(&r->lock);
+	Count d = r->depth;
+	Offset sp = r->sp;
+	PageID last = r->npages - 1;
+	pthread_mutex_unlock(&r->lock);
+	if (sp == 0) {
+		d--;
+		sp = 1u << d;
+	}
+	sp--;
+	PageID buddy = sp;
+	assert(last == buddy + (1u << d));
+	pthread_mutex_t *l1 = bucketLatch(r, buddy), *l2 = bucketLatch(r, last);
+	if (l1 > l2) { pthread_mutex_t *l = l1; l1 = l2; l2 = l; }
+	pthread_mutex_lock(l1);
+	if (l2 != l1) pthread_mutex_lock(l2);
+
+	// take the last bucket's tuples out, emptying its chain
+
+	Bucket b = getBucket(r, last);
+	char *buf = malloc(b.npages * r->pagesize);
+	Tuple *ts = malloc((b.ntuples+1) * sizeof(Tuple));
+	Bits *hs = malloc((b.ntuples+1) * sizeof(Bits));
+	assert(buf != NULL && ts != NULL && hs != NULL);
+	Count n = 0;
+	size_t used = 0;
+	FILE *f = r->data;
+	PageID pid = last;
+	while (pid != NO_PAGE) {
+		Page pg = getPage(f, pid);
+		for (Count i = 0; i < pageNTuples(pg); i++) {
+			Tuple t = pageTuple(pg, i);
+			Count len = tupLength(t);
+			memcpy(buf+used, t, len);
+			hs[n] = pageHash(pg, i);
+			ts[n++] = buf+used;
+			used += len;
+		}
+		PageID next = pageOvflow(pg);
+		releasePage(pg);
+		if (f == r->ovflow) freeOvflowPage(r, pid);
+		f = r->ovflow;
+		pid = next;
+	}
+	assert(n == b.ntuples);
+	putPage(r->data, last, newPage(r->pagesize));
+
+	// and add them to its buddy
+
+	if (n > 0) addGroupToBucket(r, buddy, ts, hs, n);
+	pthread_mutex_lock(&r->meta);
+	dirTruncate(r->dir, last);
+	pthread_mutex_unlock(&r->meta);
+	pthread_mutex_lock(&r->lock);
+	r->npages--;
+	r->depth = d;
+	r->sp = sp;
+	pthread_mutex_unlock(&r->lock);
+	if (l2 != l1) pthread_mutex_unlock(l2);
+	pthread_mutex_unlock(l1);
+	free(hs);
+	free(ts);
+	free(buf);
+}
+
+// delete all tuples matching query string qstr (as for select)
+//   from a relation, then contract it if its split policy asks
+// returns the number of tuples deleted, or -1 if qstr is invalid
+// may be called while other threads insert
+
+int deleteFromRelation(Reln r, char *qstr)
+{
+	assert(r->mode == 'w');
+	pthread_rwlock_rdlock(&r->inserts);
+	pthread_mutex_lock(&r->splitting);
+	Query q = startQuery(r, qstr);
+	if (q == NULL) {
+		pthread_mutex_unlock(&r->splitting);
+		pthread_rwlock_unlock(&r->inserts);
+		return -1;
+	}
+	Count nb, ndel = 0;
+	PageID *bs = queryBuckets(q, &nb);
+	unsigned long long nbytes = 0;
+	for (Count i = 0; i < nb; i++) {
+		pthread_mutex_t *latch = bucketLatch(r, bs[i]);
+		pthread_mutex_lock(latch);
+		ndel += compactBucket(r, bs[i], q, &nbytes);
+		pthread_mutex_unlock(latch);
+	}
+	closeQuery(q);
+
+	pthread_mutex_lock(&r->lock);
+	r->ntups -= ndel;
+	r->nbytes -= nbytes;
+	while (r->pending == 0) {
+		SplitInfo in = { r->ntups, r->nbytes, r->nattrs, r->npages,
+		                 pageCapacity(r->pagesize), r->pagesize, 0 };
+		if (!mergeWanted(&r->split, &in)) break;
+		pthread_mutex_unlock(&r->lock);
+		mergeBuckets(r);
+		pthread_mutex_lock(&r->lock);
+	}
+	Count np = r->npages;
+	pthread_mutex_unlock(&r->lock);
+	if (fileNPages(r->data) > np) truncateFile(r->data, np);
+	if (ndel > 0) trimOvflowPages(r);
+	pthread_mutex_unlock(&r->splitting);
+	pthread_rwlock_unlock(&r->inserts);
+	return ndel;
 }
 
 // external interfaces for Reln data
@@ -385,7 +1497,13 @@ Count npages(Reln r) { return r->npages; }
 Count ntuples(Reln r) { return r->ntups; }
 Count depth(Reln r)  { return r->depth; }
 Count splitp(Reln r) { return r->sp; }
+Count pageSize(Reln r) { return r->pagesize; }
 ChVecItem *chvec(Reln r)  { return r->cv; }
+Count hashedAttrs(Reln r) { return r->hashed; }
+CvMap chvecMap(Reln r) { return r->cvmap; }
+Count relationHash(Reln r) { return r->hash; }
+Bool textIntHash(Reln r) { return r->textints; }
+Dir bucketDir(Reln r) { return r->dir; }
 
 
 // displays info about open Reln
@@ -393,30 +1511,102 @@ ChVecItem *chvec(Reln r)  { return r->cv; }
 void relationStats(Reln r)
 {
 	printf("Global Info:\n");
-	printf("#attrs:%d  #pages:%d  #tuples:%d  d:%d  sp:%d\n",
-	       r->nattrs, r->npages, r->ntups, r->depth, r->sp);
+	printf("#attrs:%d  #pages:%d  #tuples:%d  d:%d  sp:%d  pagesize:%d\n",
+	       r->nattrs, r->npages, r->ntups, r->depth, r->sp, r->pagesize);
 	printf("Choice vector\n");
 	printChVec(r->cv);
+	printCvMap(r->cvmap);
 	printf("Bucket Info:\n");
-	printf("%-4s %s\n","#","Info on pages in bucket");
-	printf("%-4s %s\n","","(pageID,#tuples,freebytes,ovflow)");
-	for (Offset pid = 0; pid < r->npages; pid++) {
-		printf("[%2d]  ",pid);
-		Page p = getPage(r->data, pid);
-		Count ntups = pageNTuples(p);
-		Count space = pageFreeSpace(p);
-		Offset ovid = pageOvflow(p);
-		printf("(d%d,%d,%d,%d)",pid,ntups,space,ovid);
-		free(p);
-		while (ovid != NO_PAGE) {
-			Offset curid = ovid;
-			p = getPage(r->ovflow, ovid);
-			ntups = pageNTuples(p);
-			space = pageFreeSpace(p);
-			ovid = pageOvflow(p);
-			printf(" -> (ov%d,%d,%d,%d)",curid,ntups,space,ovid);
-			free(p);
+	if (r->dir != NULL) {
+		// from the directory, without reading any pages
+		printf("%-4s %s\n","#","Info on bucket");
+		printf("%-4s %s\n","","(#tuples,bytesused,#pages,tail)");
+		for (Offset pid = 0; pid < r->npages; pid++) {
+			Bucket *b = dirBucket(r->dir, pid);
+			printf("[%2d]  (%d,%d,%d,%d)\n", pid, b->ntuples,
+			       b->nbytes, b->npages, b->tail);
+		}
+	}
+	else {
+		adviseFile(r->data, PAGE_SEQUENTIAL);
+		adviseFile(r->ovflow, PAGE_SEQUENTIAL);
+		printf("%-4s %s\n","#","Info on pages in bucket");
+		printf("%-4s %s\n","","(pageID,#tuples,freebytes,ovflow)");
+		for (Offset pid = 0; pid < r->npages; pid++) {
+			printf("[%2d]  ",pid);
+			Page p = getPage(r->data, pid);
+			Count ntups = pageNTuples(p);
+			Count space = pageFreeSpace(p);
+			Offset ovid = pageOvflow(p);
+			printf("(d%d,%d,%d,%d)",pid,ntups,space,ovid);
+			releasePage(p);
+			while (ovid != NO_PAGE) {
+				Offset curid = ovid;
+				p = getPage(r->ovflow, ovid);
+				ntups = pageNTuples(p);
+				space = pageFreeSpace(p);
+				ovid = pageOvflow(p);
+				printf(" -> (ov%d,%d,%d,%d)",curid,ntups,space,ovid);
+				releasePage(p);
+			}
+			putchar('\n');
+		}
+	}
+	// overflow pages not in any chain are on the free list
+	Count nfree = 0;
+	if (r->dir != NULL) {
+		nfree = fileNPages(r->ovflow);
+		for (Offset pid = 0; pid < r->npages; pid++)
+			nfree -= dirBucket(r->dir, pid)->npages - 1;
+	}
+	else {
+		for (PageID ovp = r->freeovf; ovp != NO_PAGE; nfree++) {
+			Page p = getPage(r->ovflow, ovp);
+			ovp = pageOvflow(p);
+			releasePage(p);
+		}
+	}
+	printf("Free ovflow pages: %d\n", nfree);
+	printf("Page codec: %s\n", codecName(r->codec));
+	printf("Hash function: %s%s\n", hashName(r->hash),
+	       r->textints ? " (ints hashed as text)" : "");
+	char spol[MAXERRMSG];
+	showSplitPolicy(&r->split, spol);
+	printf("Split policy: %s\n", spol);
+	if (r->dir != NULL) {
+		unsigned long long used = 0;
+		for (Offset pid = 0; pid < r->npages; pid++)
+			used += dirBucket(r->dir, pid)->nbytes;
+		printf("Load factor: %.2f\n", (double)used /
+		       ((double)r->npages * pageCapacity(r->pagesize)));
+	}
+	FILE *fs[2] = { r->data, r->ovflow };
+	char *names[2] = { "data", "ovflow" };
+	for (int i = 0; i < 2; i++) {
+		struct stat st;
+		if (fstat(fileno(fs[i]), &st) != 0) continue;
+		printf("%s file: %lld bytes, %lld bytes on disk\n", names[i],
+		       (long long)st.st_size, (long long)st.st_blocks*512);
+	}
+	if (r->codec != CODEC_NONE) {
+		// ratio of page bytes to image bytes, over both files
+		unsigned long long raw = 0, packed = 0;
+		Count npacked = 0, npages = 0;
+		for (int i = 0; i < 2; i++) {
+			unsigned long long nb; Count np;
+			Count n = fileNPages(fs[i]);
+			bufImageSizes(fs[i], n, &nb, &np);
+			raw += (unsigned long long)n * r->pagesize;
+			packed += nb; npacked += np; npages += n;
 		}
-		putchar('\n');
+		printf("Compression ratio: %.2f (%u of %u pages packed, "
+		       "%llu KB of images for %llu KB of pages)\n",
+		       packed ? (double)raw / packed : 1.0, npacked, npages,
+		       packed / 1024, raw / 1024);
 	}
+	codecStats();
+	walStats();
+	fsmStats();
+	splitStats();
+	bufStats();
 }
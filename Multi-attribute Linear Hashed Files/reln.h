@@ -8,27 +8,61 @@
 
 typedef struct RelnRep *Reln;
 
+// on-disk format version, stored in R.info
+// 0 = tuples packed in pages, 1 = pages have slot directory
+// 2 = per-relation page size, slots at start of page
+// 3 = free list of overflow pages
+// 4 = optional page compression
+// 5 = tuples stored in binary form
+// 6 = per-relation split policy
+// 7 = per-relation hash function
+// 8 = tuple hashes stored in slots
+// 9 = int values hashed in binary
+#define RELN_FORMAT 9
+
 #include "defs.h"
 #include "tuple.h"
 #include "page.h"
 #include "chvec.h"
+#include "bits.h"
+#include "dir.h"
+#include "split.h"
 
-Status newRelation(char *name, Count nattr, Count npages, Count d, char *cv);
+Status newRelation(char *name, Count nattr, Count npages, Count d, char *cv,
+                   Count pagesize, int codec, SplitPolicy *policy,
+                   int hash);
 Reln openRelation(char *name, char *mode);
+Status upgradeRelation(char *name);
+Status useDirectIO(Reln r);
+void setSyncPolicy(Reln r, int policy);
+void setBackgroundSplits(Reln r, Bool on);
+void commitRelation(Reln r);
+void setRelationSize(Reln r, Count npages, Count ntups,
+                     unsigned long long nbytes);
+Count relationTarget(Reln r, Count ntups, unsigned long long nbytes);
 void closeRelation(Reln r);
 Bool existsRelation(char *name);
 PageID addToRelation(Reln r, Tuple t);
+PageID addHashedToRelation(Reln r, Tuple t, Bits h);
+void addTuplesToRelation(Reln r, Tuple *ts, Count n);
+int deleteFromRelation(Reln r, char *qstr);
 FILE *dataFile(Reln r);
 FILE *ovflowFile(Reln r);
 Count nattrs(Reln r);
 Count npages(Reln r);
+Count ntuples(Reln r);
 Count depth(Reln r);
 Count splitp(Reln r);
+Count pageSize(Reln r);
 ChVecItem *chvec(Reln r);
+Count hashedAttrs(Reln r);
+CvMap chvecMap(Reln r);
+Count relationHash(Reln r);
+Bool textIntHash(Reln r);
+Dir bucketDir(Reln r);
 void relationStats(Reln r);
 FILE *fdata(Reln r);
 FILE *fovflow(Reln r);
 FILE *finfo(Reln r);
-Tuple nextTuple(FILE *in,PageID pid,Offset curtup);
 
 #endif
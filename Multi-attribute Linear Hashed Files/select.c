@@ -1,16 +1,21 @@
 // select.c ... run queries
 // part of Multi-attribute linear-hashed files
 // Ask a query on a named relation
-// Usage:  ./select  [-v]  RelName  v1,v2,v3,v4,...
+// Usage:  ./select  [-v]  [-d]  [-p N]  RelName  v1,v2,v3,v4,...
 // where any of the vi's can be "?" (unknown)
+// and -d uses direct I/O for pages (bypassing the OS cache)
+// and -p N reads up to N buckets ahead of the scan (0 = none),
+//   with up to N page reads in flight (at most MAXPREFETCH)
 
 #include "defs.h"
 #include "query.h"
 #include "tuple.h"
 #include "reln.h"
 #include "chvec.h"
+#include "buf.h"
+#include "prefetch.h"
 
-#define USAGE "./select  [-v]  RelName  v1,v2,v3,v4,..."
+#define USAGE "./select  [-v]  [-d]  [-p N]  RelName  v1,v2,v3,v4,..."
 
 // Main ... process args, run query
 
@@ -21,22 +26,28 @@ int main(int argc, char **argv)
 	Tuple t;  // tuple pointer
 	char err[MAXERRMSG];  // buffer for error messages
 	int verbose;  // show extra info on query progress
+	int direct;   // use direct I/O
 	char *rname;  // name of table/file
 	char *qstr;   // query string
 
 	// process command-line args
 
 	if (argc < 3) fatal(USAGE);
-	
-	if (strcmp(argv[1], "-v") == 0) {
-		verbose = 1;  rname = argv[2];  qstr = argv[3];
+	verbose = direct = 0;
+	int a;
+	for (a = 1; a < argc && argv[a][0] == '-'; a++) {
+		if (strcmp(argv[a], "-v") == 0)
+			verbose = 1;
+		else if (strcmp(argv[a], "-d") == 0)
+			direct = 1;
+		else if (strcmp(argv[a], "-p") == 0 && a+1 < argc)
+			setPrefetchDepth(atoi(argv[++a]));
+		else
+			fatal(USAGE);
 	}
-	else {
-		verbose = 0;  rname = argv[1];  qstr = argv[2];
-	}
-
+	if (a+1 >= argc) fatal(USAGE);
+	rname = argv[a];  qstr = argv[a+1];
 
-	if (verbose) { /* keeps compiler quiet */ }
 
 	// initialise relation and scanning structure
 
@@ -48,6 +59,8 @@ int main(int argc, char **argv)
 		sprintf(err, "Can't open relation: %s",rname);
 		fatal(err);
 	}
+	if (direct && useDirectIO(r) != OK)
+		fprintf(stderr, "Direct I/O not supported for %s\n", rname);
 	if ((q = startQuery(r, qstr)) == NULL) {	
 		sprintf(err, "Invalid query: %s",qstr);
 		fatal(err);
@@ -65,6 +78,7 @@ int main(int argc, char **argv)
 
 	closeQuery(q);
 	closeRelation(r);
+	if (verbose) { bufStats(); prefetchStats(); }
 
 	return 0;
 }
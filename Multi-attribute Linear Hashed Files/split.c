@@ -0,0 +1,169 @@
+// split.c ... split policies
+// part of Multi-attribute Linear-hashed Files
+// Decide when a relation should grow by splitting a bucket
+
+#include "defs.h"
+#include "split.h"
+
+// Each relation has a SplitPolicy (see split.h), asked before
+//   every insert whether the next bucket should be split first
+// - SPLIT_COUNT (the original policy) splits once for every
+//   pagesize/(10*nattrs) tuples, whatever their size
+// - SPLIT_LOAD splits when the bytes stored (tuples and slots)
+//   would exceed fill+slack percent of the space in the buckets'
+//   data pages; overflow pages don't count as capacity, so long
+//   chains push the load factor up and cause splits
+// - for either policy, maxchain > 0 also splits whenever the chain
+//   receiving the tuple already has more than maxchain pages
+// The slack is hysteresis: splits start above fill+slack, and a
+//   relation only shrinks (by merging the last split's buckets
+//   again) while it would still be below fill-slack afterwards, so
+//   a relation near its target never alternates between the two
+// Only SPLIT_LOAD shrinks relations; SPLIT_COUNT has no notion of
+//   how full a relation is, so it keeps the buckets it has
+// A policy is written as "count" or "load", optionally followed
+//   by ",fill=N", ",slack=N" and ",chain=N"
+
+typedef Bool (*Controller)(SplitPolicy *, SplitInfo *);
+
+static struct {
+	Count checks;   // decisions made
+	Count bycount;  // splits due to number of tuples
+	Count byload;   // splits due to load factor
+	Count bychain;  // splits due to chain length
+	Count longest;  // longest chain seen by a decision
+	Count merges;   // splits undone, as tuples were deleted
+} stats;
+
+static char *names[NSPLITPOLICIES] = { "count", "load" };
+
+static Bool countController(SplitPolicy *sp, SplitInfo *in)
+{
+	Count per = in->pagesize / (10 * in->nattrs);
+	return (in->ntups % per == 0);
+}
+
+static Bool loadController(SplitPolicy *sp, SplitInfo *in)
+{
+	unsigned long long cap = (unsigned long long)in->npages * in->capacity;
+	return in->nbytes * 100 > cap * (sp->fill + sp->slack);
+}
+
+static Controller controllers[NSPLITPOLICIES] = {
+	countController, loadController
+};
+
+void defaultSplitPolicy(SplitPolicy *sp)
+{
+	sp->policy = SPLIT_LOAD;
+	sp->fill = SPLIT_FILL;
+	sp->slack = SPLIT_SLACK;
+	sp->maxchain = 0;
+}
+
+// parse a policy description (see above) into *sp
+// returns 0 status if successful, -1 if it is not valid
+
+Status parseSplitPolicy(char *str, SplitPolicy *sp)
+{
+	char buf[MAXERRMSG];
+	if (strlen(str) >= MAXERRMSG) return -1;
+	strcpy(buf, str);
+	defaultSplitPolicy(sp);
+	char *tok = strtok(buf, ",");
+	if (tok == NULL) return -1;
+	for (sp->policy = 0; sp->policy < NSPLITPOLICIES; sp->policy++)
+		if (strcmp(tok, names[sp->policy]) == 0) break;
+	if (sp->policy == NSPLITPOLICIES) return -1;
+	while ((tok = strtok(NULL, ",")) != NULL) {
+		int val;
+		char key[10];
+		if (sscanf(tok, "%9[a-z]=%d", key, &val) != 2 || val < 0)
+			return -1;
+		if (strcmp(key, "fill") == 0 && val > 0 && val <= 100)
+			sp->fill = val;
+		else if (strcmp(key, "slack") == 0 && val < 100)
+			sp->slack = val;
+		else if (strcmp(key, "chain") == 0)
+			sp->maxchain = val;
+		else
+			return -1;
+	}
+	if (sp->slack >= sp->fill) return -1;
+	return OK;
+}
+
+// write the description of policy sp in buf
+
+void showSplitPolicy(SplitPolicy *sp, char *buf)
+{
+	if (sp->policy == SPLIT_LOAD)
+		sprintf(buf, "load,fill=%d,slack=%d", sp->fill, sp->slack);
+	else
+		sprintf(buf, "%s", names[sp->policy]);
+	if (sp->maxchain > 0)
+		sprintf(buf+strlen(buf), ",chain=%d", sp->maxchain);
+}
+
+// should a bucket be split before the insert described by in?
+
+Bool splitWanted(SplitPolicy *sp, SplitInfo *in)
+{
+	assert(sp->policy < NSPLITPOLICIES);
+	stats.checks++;
+	if (in->chain > stats.longest) stats.longest = in->chain;
+	if (controllers[sp->policy](sp, in)) {
+		if (sp->policy == SPLIT_COUNT)
+			stats.bycount++;
+		else
+			stats.byload++;
+		return TRUE;
+	}
+	if (sp->maxchain > 0 && in->chain > sp->maxchain) {
+		stats.bychain++;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// should the last split be undone, after the deletes described
+//   by in? (a relation always keeps at least two buckets)
+
+Bool mergeWanted(SplitPolicy *sp, SplitInfo *in)
+{
+	if (sp->policy != SPLIT_LOAD || in->npages <= 2) return FALSE;
+	unsigned long long cap = (unsigned long long)(in->npages-1)
+	                         * in->capacity;
+	if (in->nbytes * 100 >= cap * (sp->fill - sp->slack)) return FALSE;
+	stats.merges++;
+	return TRUE;
+}
+
+// how many buckets a relation with in->npages buckets would have
+//   after in->ntups tuples (of in->nbytes) were inserted into it
+// (chain lengths can't be known in advance, so maxchain is ignored)
+
+Count splitTarget(SplitPolicy *sp, SplitInfo *in)
+{
+	if (sp->policy == SPLIT_COUNT)
+		return in->npages + in->ntups / (in->pagesize / (10*in->nattrs));
+	unsigned long long per = (unsigned long long)in->capacity
+	                         * (sp->fill + sp->slack);
+	unsigned long long n = (in->nbytes * 100 + per-1) / per;
+	return (n > in->npages) ? n : in->npages;
+}
+
+// display split decision counters for this process
+
+void splitStats()
+{
+	if (stats.checks > 0) {
+		Count nsplits = stats.bycount + stats.byload + stats.bychain;
+		printf("Splits: %u decisions, %u splits (%u by count, %u by load, "
+		       "%u by chain length), longest chain %u pages\n",
+		       stats.checks, nsplits, stats.bycount, stats.byload,
+		       stats.bychain, stats.longest);
+	}
+	if (stats.merges > 0)
+		printf("Merges: %u buckets merged\n", stats.merges);
+}
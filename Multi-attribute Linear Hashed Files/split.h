@@ -0,0 +1,45 @@
+// split.h ... interface to split policies
+// part of Multi-attribute Linear-hashed Files
+// See split.c for details of policies and functions
+
+#ifndef SPLIT_H
+#define SPLIT_H 1
+
+#include "defs.h"
+
+// split policies (stored in R.info)
+#define SPLIT_COUNT 0  // one split per pagesize/(10*nattrs) tuples
+#define SPLIT_LOAD  1  // keep bytes stored near a fraction of capacity
+#define NSPLITPOLICIES 2
+
+// defaults for new relations
+#define SPLIT_FILL  75  // target load factor (percent)
+#define SPLIT_SLACK 5   // hysteresis (percent either side of fill)
+
+typedef struct {
+	Count policy;    // SPLIT_COUNT or SPLIT_LOAD
+	Count fill;      // target load factor, in percent (SPLIT_LOAD)
+	Count slack;     // hysteresis, in percent (SPLIT_LOAD)
+	Count maxchain;  // also split if a chain is longer (0 = no limit)
+} SplitPolicy;
+
+// what a policy knows about a relation when asked about a split
+typedef struct {
+	Count ntups;     // tuples, including the one being inserted
+	unsigned long long nbytes;  // page space they use
+	Count nattrs;    // attributes per tuple
+	Count npages;    // buckets
+	Count capacity;  // bytes of free space in an empty page
+	Count pagesize;  // bytes per page
+	Count chain;     // pages in the chain receiving the new tuple
+} SplitInfo;
+
+void defaultSplitPolicy(SplitPolicy *);
+Status parseSplitPolicy(char *, SplitPolicy *);
+void showSplitPolicy(SplitPolicy *, char *);
+Bool splitWanted(SplitPolicy *, SplitInfo *);
+Bool mergeWanted(SplitPolicy *, SplitInfo *);
+Count splitTarget(SplitPolicy *, SplitInfo *);
+void splitStats(void);
+
+#endif
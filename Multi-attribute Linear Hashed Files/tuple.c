@@ -2,6 +2,7 @@
 // part of Multi-attribute Linear-hashed Files
 // Last modified by John Shepherd, July 2019
 
+#include <limits.h>
 #include "defs.h"
 #include "tuple.h"
 #include "reln.h"
@@ -9,11 +10,128 @@
 #include "chvec.h"
 #include "bits.h"
 
-// return number of bytes/chars in a tuple
+// A Tuple is a sequence of bytes laid out as
+// - nattrs: one byte, number of attribute values
+// - ints: two bytes, bit i set if value i is stored as an int
+// - ends: one byte per value, offset just past the value's bytes
+// - the values themselves, back to back (no separators or '\0')
+// So value i occupies bytes [ends[i-1],ends[i]) (or starts just
+//   after the header, for i == 0), and can be reached directly
+// Values which are integers in canonical form (e.g. "42", "-7",
+//   but not "007" or "+7") that fit in an int are stored as
+//   4-byte binary ints; all other values are stored as text
+// Because the int form is canonical, two values are equal exactly
+//   when their types and bytes are equal, and the text form of any
+//   value can be recovered exactly (see tupleString())
+// A value of "?" stands for an unknown value (in queries)
+// Header fields are single bytes, so a tuple must fit in 255 bytes
+//   (MAXTUPLEN chars of text always do); tuples are only made from
+//   text of at most MAXTUPLEN-1 chars, and the text form of a tuple
+//   is the text it was made from, so it always fits in a buffer of
+//   MAXTUPLEN chars
+
+#define NA(t)     ((Byte)(t)[0])
+#define HDRLEN(n) (3 + (n))
+#define MAXBINLEN MAXTUPBYTES
+#define MAXATTRS  16    // bits in ints
+
+static Count intMask(Tuple t)
+{
+	return (Byte)t[1] | ((Byte)t[2] << 8);
+}
+
+// offset of start of value i
+static Count startOf(Tuple t, Count i)
+{
+	return (i == 0) ? HDRLEN(NA(t)) : (Byte)t[3+i-1];
+}
+
+// return number of bytes in a tuple
 
 int tupLength(Tuple t)
 {
-	return strlen(t);
+	Count n = NA(t);
+	return (n == 0) ? HDRLEN(0) : (Byte)t[3+n-1];
+}
+
+// is str[0..len) an int in canonical form? if so, set *val
+
+static Bool parseInt(char *str, Count len, int *val)
+{
+	Count i = 0;
+	Bool neg = FALSE;
+	if (len > 0 && str[0] == '-') { neg = TRUE; i = 1; }
+	if (i >= len || len-i > 10) return FALSE;
+	if (str[i] == '0' && (len-i > 1 || neg)) return FALSE;
+	long long v = 0;
+	for (; i < len; i++) {
+		if (str[i] < '0' || str[i] > '9') return FALSE;
+		v = v*10 + (str[i]-'0');
+	}
+	if (neg) v = -v;
+	if (v < INT_MIN || v > INT_MAX) return FALSE;
+	*val = (int)v;
+	return TRUE;
+}
+
+// number of values in text form str[0..len)
+
+static Count countAttrs(char *str, Count len)
+{
+	Count n = 1;
+	char *c = str, *end = str + len;
+	while ((c = memchr(c, ',', end - c)) != NULL) { n++; c++; }
+	return n;
+}
+
+// make a tuple in buf (MAXTUPBYTES long) from its text form
+//   "val_1,val_2,...,val_n" in str[0..len) (with no '\0' needed)
+// returns the tuple's length, or 0 if it would be too big
+// (text longer than MAXTUPLEN-1 chars is too big, so that the text
+//   form of any tuple fits in MAXTUPLEN chars; see tupleString())
+
+static Count packTuple(char *str, Count len, char *buf)
+{
+	if (len > MAXTUPLEN-1) return 0;
+	Count n = countAttrs(str, len);
+	if (n > MAXATTRS) return 0;
+	buf[0] = n;
+	Count ints = 0, o = HDRLEN(n);
+	char *c0 = str, *end = str + len;
+	for (Count i = 0; i < n; i++) {
+		char *c = memchr(c0, ',', end - c0);
+		if (c == NULL) c = end;
+		char *v = c0;
+		Count vlen = c - c0;
+		int iv;
+		if (parseInt(v, vlen, &iv)) {
+			ints |= 1 << i;
+			v = (char *)&iv;
+			vlen = sizeof(int);
+		}
+		if (o + vlen > MAXBINLEN) return 0;
+		memcpy(buf+o, v, vlen);
+		o += vlen;
+		buf[3+i] = o;
+		c0 = c+1;
+	}
+	buf[1] = ints & 0xff;
+	buf[2] = (ints >> 8) & 0xff;
+	return o;
+}
+
+// make a tuple from its text form "val_1,val_2,...,val_n"
+// returns NULL if the tuple would be too big
+
+Tuple makeTuple(char *str)
+{
+	char buf[MAXBINLEN];
+	Count n = packTuple(str, strlen(str), buf);
+	if (n == 0) return NULL;
+	Tuple t = malloc(n);
+	assert(t != NULL);
+	memcpy(t, buf, n);
+	return t;
 }
 
 // reads/parses next tuple in input
@@ -24,91 +142,212 @@ Tuple readTuple(Reln r, FILE *in)
 	if (fgets(line, MAXTUPLEN-1, in) == NULL)
 		return NULL;
 	line[strlen(line)-1] = '\0';
-	// count fields
-	// cheap'n'nasty parsing
-	char *c; int nf = 1;
-	for (c = line; *c != '\0'; c++)
-		if (*c == ',') nf++;
+	Tuple t = makeTuple(line); // needs to be free'd sometime
 	// invalid tuple
-	if (nf != nattrs(r)) return NULL;
-	return copyString(line); // needs to be free'd sometime
+	if (t != NULL && tupleNAttrs(t) != nattrs(r)) {
+		free(t);
+		return NULL;
+	}
+	return t;
 }
 
-// extract values into an array of strings
+// parse the next line of in into a tuple in buf (which must hold
+//   MAXTUPBYTES), without copying or allocating anything else
+// returns buf, or NULL at end of input or if the line does not
+//   hold a tuple for r, or is longer than MAXTUPLEN-1 chars (which
+//   is reported, as input stops short of the end)
 
-void tupleVals(Tuple t, char **vals)
+Tuple scanTuple(Reln r, Input in, char *buf)
 {
-	char *c = t, *c0 = t;
-	int i = 0;
-	for (;;) {
-		while (*c != ',' && *c != '\0') c++;
-		if (*c == '\0') {
-			// end of tuple; add last field to vals
-			vals[i++] = copyString(c0);
-			break;
-		}
-		else {
-			// end of next field; add to vals
-			*c = '\0';
-			vals[i++] = copyString(c0);
-			*c = ',';
-			c++; c0 = c;
-		}
+	Count len;
+	char *line = nextLine(in, &len);
+	if (line == NULL) return NULL;
+	if (len > MAXTUPLEN-1) {
+		fprintf(stderr, "Line too long (over %d chars)\n", MAXTUPLEN-1);
+		return NULL;
 	}
+	if (countAttrs(line, len) != nattrs(r)) return NULL;
+	if (packTuple(line, len, buf) == 0) return NULL;
+	return buf;
 }
 
-// release memory used for separate attirubte values
+// make a separately allocated copy of a tuple
+// (e.g. of one that lives in a page)
 
-void freeVals(char **vals, int nattrs)
+Tuple copyTuple(Tuple t)
 {
-	int i;
-	for (i = 0; i < nattrs; i++) free(vals[i]);
+	Count n = tupLength(t);
+	Tuple c = malloc(n);
+	assert(c != NULL);
+	memcpy(c, t, n);
+	return c;
 }
 
-// hash a tuple using the choice vector
-// TODO: actually use the choice vector to make the hash
+Count tupleNAttrs(Tuple t) { return NA(t); }
 
-Bits tupleHash(Reln r, Tuple t)
+// return pointer to bytes of value i, and set *len to their number
+// (for an int value, these are the bytes of the int)
+
+char *tupleAttr(Tuple t, Count i, Count *len)
 {
-	char buf[MAXBITS+1];
-	Count nvals = nattrs(r);
-	char **vals = malloc(nvals*sizeof(char *));
-	assert(vals != NULL);
-	tupleVals(t, vals);
+	assert(i < NA(t));
+	Count start = startOf(t, i);
+	*len = (Byte)t[3+i] - start;
+	return t + start;
+}
 
-	int i = 0;
-	int j = 0;
-	ChVecItem *cv;
+Bool tupleIsInt(Tuple t, Count i)
+{
+	return (intMask(t) >> i) & 1;
+}
 
-	Bits hash = 0;
-	Bits val_hash[MAXBITS+1];
-	Byte a, b;
+int tupleInt(Tuple t, Count i)
+{
+	assert(tupleIsInt(t, i));
+	int v;
+	memcpy(&v, t + startOf(t, i), sizeof(int));
+	return v;
+}
+
+// is value i of t known (i.e. not "?")
+
+Bool tupleKnown(Tuple t, Count i)
+{
+	if (tupleIsInt(t, i)) return TRUE;
+	Count len;
+	char *v = tupleAttr(t, i, &len);
+	return !(len == 1 && v[0] == '?');
+}
+
+// decimal form of v in buf; returns its length
+// (much cheaper than sprintf, and used for every int shown)
+
+static Count intText(int v, char *buf)
+{
+	char digits[12];
+	unsigned int u = (v < 0) ? -(unsigned int)v : v;
+	Count n = 0, len = 0;
+	do { digits[n++] = '0' + u%10; u /= 10; } while (u > 0);
+	if (v < 0) buf[len++] = '-';
+	while (n > 0) buf[len++] = digits[--n];
+	buf[len] = '\0';
+	return len;
+}
+
+// text form of value i in buf; returns its length
 
-	while (i < nvals)
-	{
-		val_hash[i] = hash_any((unsigned char *)vals[i],strlen(vals[i]));
-		i++;
+static Count attrText(Tuple t, Count i, char *buf)
+{
+	if (tupleIsInt(t, i))
+		return intText(tupleInt(t, i), buf);
+	Count len;
+	char *v = tupleAttr(t, i, &len);
+	memcpy(buf, v, len);
+	buf[len] = '\0';
+	return len;
+}
+
+// hash value i of t with hash function hash (see hash.h)
+// an int value is hashed as its 4 bytes, or, if textints, as its
+//   text (as relations from before format 9 did), which costs it
+//   a conversion to text every time
+
+Bits attrHashWith(int hash, Bool textints, Tuple t, Count i)
+{
+	if (textints && tupleIsInt(t, i)) {
+		char buf[16];
+		Count len = attrText(t, i, buf);
+		return hashBytes(hash, (unsigned char *)buf, len);
 	}
+	Count len;
+	char *v = tupleAttr(t, i, &len);
+	return hashBytes(hash, (unsigned char *)v, len);
+}
 
-	cv = chvec(r);
+// hash value i of t, as relation r does
 
-	while (j < MAXCHVEC)
-	{
-		a = cv[j].att;
-		b = cv[j].bit;
+Bits attrHash(Reln r, Tuple t, Count i)
+{
+	return attrHashWith(relationHash(r), textIntHash(r), t, i);
+}
+
+// hash a tuple using the choice vector
+// bit j of the hash is bit cv[j].bit of the hash of value cv[j].att,
+//   so only the values the choice vector refers to are hashed (once
+//   each), straight from the tuple's bytes, and their bits are
+//   placed by the compiled choice vector (see compileChVec())
 
-		if (bitIsSet(val_hash[a], b)) 
-		{
-			hash = setBit(hash, j);
-        }
-		j++;
+Bits tupleHash(Reln r, Tuple t)
+{
+	Bits vals[MAXATTRS];
+	int fn = relationHash(r);
+	Bool textints = textIntHash(r);
+	Count used = hashedAttrs(r);
+	for (Count i = 0; used != 0; i++, used >>= 1)
+		if (used & 1) vals[i] = attrHashWith(fn, textints, t, i);
+	return cvHash(chvecMap(r), vals);
+}
+
+// set keys[i] and lens[i] to the bytes hashed for value a of ts[i],
+//   for each of the n tuples in ts (ints are written in ibufs, if
+//   they are hashed as text)
+
+static void gatherValues(Tuple *ts, Count n, Count a, Bool textints,
+                         unsigned char **keys, int *lens, char (*ibufs)[16])
+{
+	for (Count i = 0; i < n; i++) {
+		Count len;
+		if (textints && tupleIsInt(ts[i], a)) {
+			len = attrText(ts[i], a, ibufs[i]);
+			keys[i] = (unsigned char *)ibufs[i];
+		}
+		else
+			keys[i] = (unsigned char *)tupleAttr(ts[i], a, &len);
+		lens[i] = len;
 	}
+}
 
-	bitsString(hash,buf);
+// hash the n tuples in ts as tupleHash() does, into hashes[0..n)
+// the values of each attribute are hashed HASHBATCH tuples at a
+//   time, side by side (see hashBatch())
 
-	printf("hash(%s) = %s\n", vals[0], buf);
+void tupleHashes(Reln r, Tuple *ts, Count n, Bits *hashes)
+{
+	Bits vals[MAXATTRS][HASHBATCH], v[MAXATTRS];
+	unsigned char *keys[HASHBATCH];
+	int lens[HASHBATCH];
+	char ibufs[HASHBATCH][16];
+	int fn = relationHash(r);
+	Bool textints = textIntHash(r);
+	CvMap cv = chvecMap(r);
+	for (Count i = 0; i < n; i += HASHBATCH) {
+		Count m = (n - i < HASHBATCH) ? n - i : HASHBATCH;
+		Count used = hashedAttrs(r);
+		for (Count a = 0; used != 0; a++, used >>= 1) {
+			if (!(used & 1)) continue;
+			gatherValues(ts+i, m, a, textints, keys, lens, ibufs);
+			hashBatch(fn, keys, lens, m, vals[a]);
+		}
+		for (Count k = 0; k < m; k++) {
+			used = hashedAttrs(r);
+			for (Count a = 0; used != 0; a++, used >>= 1)
+				if (used & 1) v[a] = vals[a][k];
+			hashes[i+k] = cvHash(cv, v);
+		}
+	}
+}
 
-	return hash;
+// hash every value of t (as attrHash() does) into hashes[], at once
+
+void attrHashes(Reln r, Tuple t, Bits *hashes)
+{
+	Count n = NA(t);
+	unsigned char *keys[MAXATTRS];
+	int lens[MAXATTRS];
+	char ibufs[MAXATTRS][16];
+	for (Count a = 0; a < n; a++)
+		gatherValues(&t, 1, a, textIntHash(r), keys+a, lens+a, ibufs+a);
+	hashBatch(relationHash(r), keys, lens, n, hashes);
 }
 
 // compare two tuples (allowing for "unknown" values)
@@ -116,25 +355,36 @@ Bits tupleHash(Reln r, Tuple t)
 Bool tupleMatch(Reln r, Tuple t1, Tuple t2)
 {
 	Count na = nattrs(r);
-	char **v1 = malloc(na*sizeof(char *));
-	tupleVals(t1, v1);
-	char **v2 = malloc(na*sizeof(char *));
-	tupleVals(t2, v2);
-	Bool match = TRUE;
-	int i;
-	for (i = 0; i < na; i++) {
-		// assumes no real attribute values start with '?'
-		if (v1[i][0] == '?' || v2[i][0] == '?') continue;
-		if (strcmp(v1[i],v2[i]) == 0) continue;
-		match = FALSE;
+	for (Count i = 0; i < na; i++) {
+		if (!tupleKnown(t1, i) || !tupleKnown(t2, i)) continue;
+		if (tupleIsInt(t1, i) != tupleIsInt(t2, i)) return FALSE;
+		Count n1, n2;
+		char *v1 = tupleAttr(t1, i, &n1);
+		char *v2 = tupleAttr(t2, i, &n2);
+		if (n1 != n2 || memcmp(v1, v2, n1) != 0) return FALSE;
 	}
-	freeVals(v1,na); freeVals(v2,na);
-	return match;
+	return TRUE;
 }
 
 // puts printable version of tuple in user-supplied buffer
 
 void tupleString(Tuple t, char *buf)
 {
-	strcpy(buf,t);
+	Count n = NA(t), ints = intMask(t);
+	Count start = HDRLEN(n);
+	for (Count i = 0; i < n; i++) {
+		Count end = (Byte)t[3+i];
+		if (i > 0) *buf++ = ',';
+		if ((ints >> i) & 1) {
+			int v;
+			memcpy(&v, t + start, sizeof(int));
+			buf += intText(v, buf);
+		}
+		else {
+			memcpy(buf, t + start, end - start);
+			buf += end - start;
+		}
+		start = end;
+	}
+	*buf = '\0';
 }
@@ -1,8 +1,8 @@
 // tuple.h ... interface to functions on Tuples
 // part of Multi-attribute Linear-hashed Files
-// A Tuple is just a '\0'-terminated C string
-// Consists of "val_1,val_2,val_3,...,val_n"
-// See tuple.c for details on functions
+// A Tuple is a binary record holding n attribute values
+// It is made from, and shown as, "val_1,val_2,val_3,...,val_n"
+// See tuple.c for details on layout and functions
 // Last modified by John Shepherd, July 2019
 
 #ifndef TUPLE_H
@@ -10,14 +10,31 @@
 
 typedef char *Tuple;
 
+// most bytes in a tuple (header fields are single bytes)
+#define MAXTUPBYTES 255
+
+// tuples whose values are hashed together by tupleHashes()
+#define HASHBATCH 64
+
 #include "reln.h"
 #include "bits.h"
+#include "input.h"
 
 int tupLength(Tuple t);
 Tuple readTuple(Reln r, FILE *in);
+Tuple scanTuple(Reln r, Input in, char *buf);
+Tuple makeTuple(char *str);
+Tuple copyTuple(Tuple t);
+Count tupleNAttrs(Tuple t);
+char *tupleAttr(Tuple t, Count i, Count *len);
+Bool tupleIsInt(Tuple t, Count i);
+int tupleInt(Tuple t, Count i);
+Bool tupleKnown(Tuple t, Count i);
+Bits attrHashWith(int hash, Bool textints, Tuple t, Count i);
+Bits attrHash(Reln r, Tuple t, Count i);
 Bits tupleHash(Reln r, Tuple t);
-void tupleVals(Tuple t, char **vals);
-void freeVals(char **vals, int nattrs);
+void tupleHashes(Reln r, Tuple *ts, Count n, Bits *hashes);
+void attrHashes(Reln r, Tuple t, Bits *hashes);
 Bool tupleMatch(Reln r, Tuple t1, Tuple t2);
 void tupleString(Tuple t, char *buf);
 
@@ -0,0 +1,32 @@
+// upgrade.c ... convert a Relation to the current on-disk format
+// part of Multi-attribute linear-hashed files
+// Rewrites pages of relations created by older versions in place
+// Usage:  ./upgrade  RelName
+
+#include "defs.h"
+#include "reln.h"
+
+#define USAGE "./upgrade  RelName"
+
+// Main ... process args, convert relation
+
+int main(int argc, char **argv)
+{
+	char err[MAXERRMSG+20];  // buffer for error messages
+
+	// process command-line args
+
+	if (argc < 2) fatal(USAGE);
+	char *relname = argv[1];
+
+	// convert relation
+
+	if (!existsRelation(relname))
+		fatal("No such relation");
+	if (upgradeRelation(relname) != OK) {
+		sprintf(err, "Can't upgrade relation: %s", relname);
+		fatal(err);
+	}
+
+	return 0;
+}
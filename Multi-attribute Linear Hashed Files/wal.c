@@ -0,0 +1,363 @@
+// wal.c ... write-ahead (redo) log for a relation
+// part of Multi-attribute Linear-hashed Files
+// Makes changes to a relation's pages durable with sequential
+//   writes to R.wal, instead of random writes to R.data/R.ovflow
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "defs.h"
+#include "wal.h"
+#include "page.h"
+#include "buf.h"
+#include "hash.h"
+
+// The log is a sequence of records, each a RecHdr plus payload
+// - PAGE records hold the full image of one page of one file
+// - COMMIT records hold the relation's header (R.info contents)
+// A file's pages are never written to the file itself while it is
+//   attached to a log; the buffer pool sends them here instead
+//   (see buf.c), whether on commit or when a frame is evicted
+// - an index maps each (file,page) to its latest image in the log,
+//   so that evicted pages can be read back
+// A commit sends all dirty pages to the log, then a COMMIT record,
+//   then (depending on the sync policy) one fdatasync() of the log
+// - so a batch of inserts costs one sequential sync, and the
+//   random writes to the relation's files happen later, at a
+//   checkpoint, when the latest images are copied to their files
+// A page logged again before the next commit overwrites its own
+//   uncommitted record, rather than adding another; so the pages
+//   the pool evicts during a long batch don't make the log grow
+//   without limit
+// Recovery replays every PAGE record up to the last COMMIT, and
+//   restores the header from that COMMIT; later records belong to
+//   changes which were never committed, and are ignored
+// Each record has a checksum, so a torn write at the end of the
+//   log is recognised as the end of the log
+
+#define PAGE_REC   1
+#define COMMIT_REC 2
+#define MAXWALFILES 2
+#define WALBUFSIZE (1024*1024)
+
+typedef struct {
+	Count  type;  // PAGE_REC or COMMIT_REC
+	Count  tag;   // which attached file (for PAGE_REC)
+	PageID pid;   // which page (for PAGE_REC)
+	Count  len;   // bytes of payload after header
+	Count  sum;   // checksum of header (with sum=0) and payload
+} RecHdr;
+
+// where the latest image of each page of a file is in the log
+typedef struct {
+	FILE  *file;
+	off_t *offs;   // offs[pid] (0 if page not in log)
+	Count  noffs;  // entries in offs[]
+} Index;
+
+struct WalRep {
+	FILE  *log;    // handle on R.wal
+	int    sync;   // sync policy
+	off_t  end;    // bytes written to log (incl. stdio buffer)
+	off_t  flushed; // bytes passed to the kernel
+	off_t  committed; // end of last commit record
+	Index  files[MAXWALFILES];
+	Count  nfiles;
+	pthread_mutex_t lock;
+};
+
+static struct {
+	Count pages;       // page images logged
+	Count commits;     // commit records
+	Count syncs;       // fdatasync() calls
+	Count applied;     // pages copied to their files
+	Count checkpoints; // times log was emptied
+} stats;
+
+static Count checksum(RecHdr *h, char *data)
+{
+	RecHdr c = *h;
+	c.sum = 0;
+	Count sum = hash_any((unsigned char *)&c, sizeof(RecHdr));
+	if (h->len > 0) sum ^= hash_any((unsigned char *)data, h->len);
+	return sum;
+}
+
+static void walName(char *fname, char *name)
+{
+	sprintf(fname, "%s.wal", name);
+}
+
+// does relation name have a non-empty log (needing recovery)?
+
+Bool walPending(char *name)
+{
+	char fname[MAXFILENAME];
+	struct stat st;
+	walName(fname, name);
+	return (stat(fname, &st) == 0 && st.st_size > 0);
+}
+
+// open (or create) the log for relation name
+
+Wal openWal(char *name, int sync)
+{
+	char fname[MAXFILENAME];
+	walName(fname, name);
+	Wal w = malloc(sizeof(struct WalRep));
+	assert(w != NULL);
+	// not O_APPEND, since uncommitted records are rewritten in place
+	int fd = open(fname, O_RDWR|O_CREAT, 0644);
+	w->log = (fd < 0) ? NULL : fdopen(fd, "r+");
+	if (w->log == NULL) fatal("Can't open log file");
+	setvbuf(w->log, NULL, _IOFBF, WALBUFSIZE);
+	fseeko(w->log, 0, SEEK_END);
+	w->end = w->flushed = w->committed = ftello(w->log);
+	w->sync = sync;
+	w->nfiles = 0;
+	pthread_mutex_init(&w->lock, NULL);
+	return w;
+}
+
+// finished with the log (does not commit)
+
+void closeWal(Wal w)
+{
+	for (Count i = 0; i < w->nfiles; i++)
+		free(w->files[i].offs);
+	fclose(w->log);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
+
+// record the pages of f in this log
+// files must be attached in the same order each time the log is used
+
+void walAttach(Wal w, FILE *f)
+{
+	assert(w->nfiles < MAXWALFILES);
+	Index *ix = &w->files[w->nfiles++];
+	ix->file = f;
+	ix->offs = NULL;
+	ix->noffs = 0;
+}
+
+static Count tagOf(Wal w, FILE *f)
+{
+	for (Count i = 0; i < w->nfiles; i++)
+		if (w->files[i].file == f) return i;
+	assert(FALSE);
+	return 0;
+}
+
+static void setOffset(Index *ix, PageID pid, off_t off)
+{
+	if (pid >= ix->noffs) {
+		Count n = (ix->noffs == 0) ? 64 : ix->noffs;
+		while (n <= pid) n *= 2;
+		ix->offs = realloc(ix->offs, n * sizeof(off_t));
+		assert(ix->offs != NULL);
+		memset(ix->offs + ix->noffs, 0, (n - ix->noffs) * sizeof(off_t));
+		ix->noffs = n;
+	}
+	ix->offs[pid] = off;
+}
+
+// append a record (called with lock held)
+// returns offset of payload in log
+
+static off_t append(Wal w, Count type, Count tag, PageID pid,
+                    char *data, Count len)
+{
+	RecHdr h = { type, tag, pid, len, 0 };
+	h.sum = checksum(&h, data);
+	if (fwrite(&h, sizeof(RecHdr), 1, w->log) != 1 ||
+	    (len > 0 && fwrite(data, len, 1, w->log) != 1))
+		fatal("Can't write to log file");
+	off_t off = w->end + sizeof(RecHdr);
+	w->end = off + len;
+	return off;
+}
+
+// log the current image of page pid of f
+
+void walWrite(Wal w, FILE *f, PageID pid, char *buf)
+{
+	pthread_mutex_lock(&w->lock);
+	Count tag = tagOf(w, f);
+	Index *ix = &w->files[tag];
+	Count size = filePageSize(f);
+	off_t old = (pid < ix->noffs) ? ix->offs[pid] : 0;
+	if (old > w->committed) {
+		// overwrite the uncommitted image in place
+		RecHdr h = { PAGE_REC, tag, pid, size, 0 };
+		h.sum = checksum(&h, buf);
+		if (old + size > w->flushed) {
+			fflush(w->log);
+			w->flushed = w->end;
+		}
+		int fd = fileno(w->log);
+		if (pwrite(fd, &h, sizeof(RecHdr), old - sizeof(RecHdr)) != sizeof(RecHdr)
+		    || pwrite(fd, buf, size, old) != size)
+			fatal("Can't write to log file");
+	}
+	else
+		setOffset(ix, pid, append(w, PAGE_REC, tag, pid, buf, size));
+	stats.pages++;
+	pthread_mutex_unlock(&w->lock);
+}
+
+// fetch latest logged image of page pid of f into buf
+// returns 0 status if found, -1 if page is not in the log
+
+Status walRead(Wal w, FILE *f, PageID pid, char *buf)
+{
+	pthread_mutex_lock(&w->lock);
+	Index *ix = &w->files[tagOf(w, f)];
+	off_t off = (pid < ix->noffs) ? ix->offs[pid] : 0;
+	if (off == 0) {
+		pthread_mutex_unlock(&w->lock);
+		return -1;
+	}
+	Count size = filePageSize(f);
+	if (off + size > w->flushed) {
+		fflush(w->log);
+		w->flushed = w->end;
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (pread(fileno(w->log), buf, size, off) != size)
+		fatal("Can't read log file");
+	return OK;
+}
+
+// write a commit record holding hdr, and make the log durable
+// (all pages belonging to the commit must be logged already)
+
+void walCommit(Wal w, char *hdr, Count len)
+{
+	pthread_mutex_lock(&w->lock);
+	append(w, COMMIT_REC, 0, NO_PAGE, hdr, len);
+	fflush(w->log);
+	w->flushed = w->committed = w->end;
+	if (w->sync == WAL_SYNC_COMMIT) {
+		fdatasync(fileno(w->log));
+		stats.syncs++;
+	}
+	stats.commits++;
+	pthread_mutex_unlock(&w->lock);
+}
+
+Count walSize(Wal w) { return w->end; }
+int walSync(Wal w) { return w->sync; }
+void walSetSync(Wal w, int sync) { w->sync = sync; }
+
+// copy the latest image of every logged page to its own file
+// and make the files durable (ahead of emptying the log)
+// there must be nothing uncommitted in the log
+
+void walApply(Wal w)
+{
+	pthread_mutex_lock(&w->lock);
+	fflush(w->log);
+	w->flushed = w->end;
+	char *buf = malloc(MAXPAGESIZE);
+	assert(buf != NULL);
+	for (Count i = 0; i < w->nfiles; i++) {
+		Index *ix = &w->files[i];
+		Count size = filePageSize(ix->file);
+		for (PageID pid = 0; pid < ix->noffs; pid++) {
+			if (ix->offs[pid] == 0) continue;
+			if (pread(fileno(w->log), buf, size, ix->offs[pid]) != size)
+				fatal("Can't read log file");
+			bufWriteThrough(ix->file, pid, buf);
+			stats.applied++;
+		}
+		if (w->sync != WAL_SYNC_NONE) fdatasync(fileno(ix->file));
+	}
+	free(buf);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// empty the log, once everything in it is in the relation's files
+
+void walReset(Wal w)
+{
+	pthread_mutex_lock(&w->lock);
+	fflush(w->log);
+	if (ftruncate(fileno(w->log), 0) != 0)
+		fatal("Can't truncate log file");
+	if (w->sync != WAL_SYNC_NONE) fdatasync(fileno(w->log));
+	w->end = w->flushed = w->committed = 0;
+	fseeko(w->log, 0, SEEK_SET);
+	for (Count i = 0; i < w->nfiles; i++) {
+		Index *ix = &w->files[i];
+		memset(ix->offs, 0, ix->noffs * sizeof(off_t));
+	}
+	stats.checkpoints++;
+	pthread_mutex_unlock(&w->lock);
+}
+
+// redo committed changes in the log, after a crash
+// the page images are applied to the attached files (see walApply)
+// the header from the last commit is put in hdr (which has room
+//   for WAL_MAXHDR bytes), and its length in *len
+//   (*len is 0 if nothing was committed)
+// returns 0 status if successful
+
+Status walRecover(Wal w, char *hdr, Count *len)
+{
+	int fd = fileno(w->log);
+	char *buf = malloc(MAXPAGESIZE);
+	assert(buf != NULL);
+	// pages logged since last commit (not yet known to be committed)
+	PageID *pids = NULL; Count *tags = NULL; off_t *offs = NULL;
+	Count npend = 0, maxpend = 0;
+	off_t off = 0;
+	RecHdr h;
+	*len = 0;
+	while (pread(fd, &h, sizeof(RecHdr), off) == sizeof(RecHdr)) {
+		if (h.len > MAXPAGESIZE) break;
+		if (pread(fd, buf, h.len, off+sizeof(RecHdr)) != h.len) break;
+		if (checksum(&h, buf) != h.sum) break;
+		off_t data = off + sizeof(RecHdr);
+		off = data + h.len;
+		if (h.type == PAGE_REC) {
+			if (h.tag >= w->nfiles) break;
+			if (npend == maxpend) {
+				maxpend = (maxpend == 0) ? 64 : 2*maxpend;
+				pids = realloc(pids, maxpend * sizeof(PageID));
+				tags = realloc(tags, maxpend * sizeof(Count));
+				offs = realloc(offs, maxpend * sizeof(off_t));
+				assert(pids != NULL && tags != NULL && offs != NULL);
+			}
+			pids[npend] = h.pid; tags[npend] = h.tag; offs[npend] = data;
+			npend++;
+		}
+		else if (h.type == COMMIT_REC && h.len <= WAL_MAXHDR) {
+			for (Count i = 0; i < npend; i++)
+				setOffset(&w->files[tags[i]], pids[i], offs[i]);
+			npend = 0;
+			memcpy(hdr, buf, h.len);
+			*len = h.len;
+		}
+		else
+			break;
+	}
+	free(pids); free(tags); free(offs); free(buf);
+	// log is read via pread, so nothing is buffered
+	w->end = w->flushed = w->committed = lseek(fd, 0, SEEK_END);
+	walApply(w);
+	return OK;
+}
+
+// display log counters for this process
+
+void walStats()
+{
+	if (stats.pages == 0 && stats.commits == 0) return;
+	printf("Log: %u pages logged, %u commits, %u syncs, "
+	       "%u checkpoints (%u pages applied)\n",
+	       stats.pages, stats.commits, stats.syncs,
+	       stats.checkpoints, stats.applied);
+}
@@ -0,0 +1,37 @@
+// wal.h ... interface to the write-ahead log
+// part of Multi-attribute Linear-hashed Files
+// See wal.c for details of log format and functions
+
+#ifndef WAL_H
+#define WAL_H 1
+
+typedef struct WalRep *Wal;
+
+#include "defs.h"
+
+// when commits force the log to disk
+#define WAL_SYNC_NONE   0  // never (survives a process crash only)
+#define WAL_SYNC_COMMIT 1  // at every commit (survives a system crash)
+
+// largest relation header a commit record can hold
+#define WAL_MAXHDR 1024
+
+// checkpoint once the log grows past this many bytes
+#define WAL_CHECKPOINT (16*1024*1024)
+
+Bool walPending(char *);
+Wal openWal(char *, int);
+void closeWal(Wal);
+void walAttach(Wal, FILE *);
+void walWrite(Wal, FILE *, PageID, char *);
+Status walRead(Wal, FILE *, PageID, char *);
+void walCommit(Wal, char *, Count);
+Count walSize(Wal);
+int walSync(Wal);
+void walSetSync(Wal, int);
+void walApply(Wal);
+void walReset(Wal);
+Status walRecover(Wal, char *, Count *);
+void walStats(void);
+
+#endif